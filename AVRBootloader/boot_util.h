@@ -27,25 +27,91 @@
  * functionality that is contained within the bootloader code.
  */
 
-#define BOOT_START 0x3800
+/* Word address of the start of the bootloader, which is where .text goes
+   in the bootloader's build.  Each entry in the jump table is a jmp, which
+   is two words long, so entry k is at BOOT_START + 2*k. */
+#if defined(__AVR_ATmega2561__)
+  /* The boot section is at word address 0x1F800 which doesn't fit in a
+     function pointer.  These are the low 16 bits and the application has
+     to set EIND to BOOT_EIND before it calls through them. */
+  #define BOOT_START 0xF800
+  #define BOOT_EIND  1
+#elif defined(BL_MINSIZE)
+  #define BOOT_START 0x3C00 /* The 2K MinSize build, see bootloader.h */
+#else
+  #define BOOT_START 0x3800
+#endif
+
+#define BOOT_ENTRY(k) (BOOT_START + 2 * (k))
 
 /* Bitrate definitions */
 #define BITRATE_125  0
 #define BITRATE_250  1
 #define BITRATE_500  2
 #define BITRATE_1000 3
+#define BITRATE_50   4
+#define BITRATE_100  5
+#define BITRATE_800  6
+
+/* The bootloader's frames are as big as the biggest one its CAN
+   controller can send, see can.h.  The application has to define
+   CAN_MCP2517FD too before it includes this if the bootloader was built
+   with it, or can_read() and the queues run off the end of its frames. */
+#ifdef CAN_MCP2517FD
+  #define CAN_MAX_DLEN 64
+#else
+  #define CAN_MAX_DLEN 8
+#endif
 
 struct CanFrame {
     uint16_t id;
     uint8_t length;
-    uint8_t data[8];
+    uint8_t data[CAN_MAX_DLEN];
+};
+
+void (*init_spi)(void)                                                      = BOOT_ENTRY(1);
+void (*spi_write)(uint8_t *write_buff, uint8_t *read_buff, uint8_t size)    = BOOT_ENTRY(2);
+void (*can_init)(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, uint8_t iflags)  = BOOT_ENTRY(3);
+void (*can_read)(uint8_t rxbuff, struct CanFrame *frame)                    = BOOT_ENTRY(4);
+void (*can_send)(uint8_t txbuff, uint8_t priority, struct CanFrame frame)   = BOOT_ENTRY(5);
+uint8_t (*can_mode)(uint8_t mode, uint8_t wait)                             = BOOT_ENTRY(6);
+uint8_t (*can_mask)(uint8_t rxbuff, uint16_t idmask, uint16_t datamask)     = BOOT_ENTRY(7);
+uint8_t (*can_filter)(uint8_t regid, uint16_t idfilter, uint16_t datafilter)= BOOT_ENTRY(8);
+
+#ifndef BL_MINSIZE
+/* Interrupt driven queues, see canq.h in the bootloader.  Call
+   canq_service() from the interrupt for the MCP2515's INT pin.  If the
+   bootloader was built without BL_CANQ or BL_FLASHCRC these entries are
+   still there but they restart the bootloader. */
+struct CanQueue {
+    struct CanFrame *rx;
+    struct CanFrame *tx;
+    uint8_t rx_size;
+    volatile uint8_t rx_head;
+    volatile uint8_t rx_tail;
+    uint8_t tx_size;
+    volatile uint8_t tx_head;
+    volatile uint8_t tx_tail;
+    volatile uint8_t rx_overruns;
+    uint8_t rx1_older;
+};
+
+void (*canq_init)(struct CanQueue *q, struct CanFrame *rx, uint8_t rx_size,
+                  struct CanFrame *tx, uint8_t tx_size)                     = BOOT_ENTRY(9);
+void (*canq_filter)(uint16_t mask0, uint16_t mask1, const uint16_t *ids)    = BOOT_ENTRY(10);
+uint8_t (*canq_send)(struct CanQueue *q, const struct CanFrame *frame)      = BOOT_ENTRY(11);
+uint8_t (*canq_recv)(struct CanQueue *q, struct CanFrame *frame)            = BOOT_ENTRY(12);
+void (*canq_service)(struct CanQueue *q)                                    = BOOT_ENTRY(13);
+
+/* Flash CRC, see flashcrc.h in the bootloader.  Start it with end = 0 to
+   check the whole firmware against the CRC that the uploader stored. */
+struct FlashCrc {
+    uint32_t next;
+    uint32_t end;
+    uint16_t crc;
+    uint16_t stored;
 };
 
-void (*init_spi)(void)                                                      = BOOT_START + 1;
-void (*spi_write)(uint8_t *write_buff, uint8_t *read_buff, uint8_t size)    = BOOT_START + 2;
-void (*can_init)(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, uint8_t iflags)  = BOOT_START + 3;
-void (*can_read)(uint8_t rxbuff, struct CanFrame *frame)                    = BOOT_START + 4;
-void (*can_send)(uint8_t txbuff, uint8_t priority, struct CanFrame frame)   = BOOT_START + 5;
-uint8_t (*can_mode)(uint8_t mode, uint8_t wait)                             = BOOT_START + 6;
-uint8_t (*can_mask)(uint8_t rxbuff, uint16_t idmask, uint16_t datamask)     = BOOT_START + 7;
-uint8_t (*can_filter)(uint8_t regid, uint16_t idfilter, uint16_t datafilter)= BOOT_START + 8;
+void (*flashcrc_begin)(struct FlashCrc *s, uint32_t start, uint32_t end)    = BOOT_ENTRY(14);
+uint8_t (*flashcrc_step)(struct FlashCrc *s, uint16_t budget)               = BOOT_ENTRY(15);
+#endif
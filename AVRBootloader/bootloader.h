@@ -20,9 +20,12 @@
 #define _BOOTLOADER_H
 
 // EEPROM Data Locations 
+// These belong to the bootloader and the application must not use them.
+// EE_SELFTEST is only read with BL_SELFTEST but byte 3 is kept anyway.
 #define EE_CAN_SPEED  (const uint8_t *)0x00
 #define EE_NODE_ID    (const uint8_t *)0x01
 #define EE_BAUD       (const uint8_t *)0x02
+#define EE_SELFTEST   (const uint8_t *)0x03 /* 0x01 runs the self test at reset, see selftest.h */
 
 // Verification Code for Firmware Update
 #define BL_VERIFY_LSB    0xB3
@@ -30,6 +33,126 @@
 
 // Comment this out to make all the UART debugging stuff go away.
 #define UART_DEBUG 0x01
+#define LOG_LEVEL 2 /* Only log messages at this level or below.  See log.h */
+//#define UART_BAUD 9600UL /* Overrides the default for F_CPU */
+
+// Comment this out to make the performance counters go away.  See stats.h
+#define BL_STATS 0x01
+
+/* Comment this out to make the sparse Fill Buffer and the Merge Write
+   command go away.  It takes a page of SRAM. */
+#define BL_MERGE 0x01
+
+/* Comment this out to take the CAN queues for the application out of
+   the jump table.  See canq.h */
+#define BL_CANQ 0x01
+
+/* Comment this out to take the application's flash CRC out of the jump
+   table.  See flashcrc.h */
+#define BL_FLASHCRC 0x01
+
+/* Comment this out to make the Pacing command (0x08) go away.  Without
+   it the responses all go out at priority 3 as fast as we can send them. */
+#define BL_PACING 0x01
+
+/* Comment this out to store the CRC from the Complete command without
+   checking it against the flash first. */
+#define BL_CRC_CHECK 0x01
+
+/* Comment this out to make the EEPROM Write (0x09), EEPROM Read (0x0A)
+   and Reset (0x0B) commands go away. */
+#define BL_EEPROM 0x01
+
+/* Comment this out to read the buffer data frames into a struct CanFrame
+   like everything else instead of straight into the page buffer. */
+#define BL_READ_FILL 0x01
+
+/* Uncomment BL_TRACE to keep a timestamped trace of what the bootloader
+   is doing.  It takes three bytes of SRAM for each event.  See trace.h */
+//#define BL_TRACE 0x01
+#define TRACE_SIZE 64
+
+/* Uncomment BL_STACK_PAINT to fill the free SRAM with a pattern at reset
+   and keep track of how much stack we and each of the exported
+   functions use.  See stack.h */
+//#define BL_STACK_PAINT 0x01
+
+/* Uncomment BL_SESSION_LOG to keep a record of the last few firmware
+   loads in the top 128 bytes of the EEPROM.  See session.h */
+//#define BL_SESSION_LOG 0x01
+
+/* Uncomment BL_SELFTEST to make the FIX_BL_SELFTEST query run a
+   benchmark of the SPI and CAN driver with the controller in loopback
+   mode.  See selftest.h */
+//#define BL_SELFTEST 0x01
+
+/* Uncomment CAN_AUTOBAUD to have the bootloader listen to the bus at each
+   bit rate in turn before it joins it.  The rate from EEPROM is tried first.
+   Uncomment CAN_AUTOBAUD_SAVE as well to write the detected rate back to
+   EE_CAN_SPEED. */
+//#define CAN_AUTOBAUD 0x01
+//#define CAN_AUTOBAUD_SAVE 0x01
+#define AUTOBAUD_WINDOW (BOOT_F_CPU / 1024 / 10) /* Timer 1 ticks to listen at each rate (~100mS) */
+#define AUTOBAUD_PASSES 2 /* Number of times to go through all the rates */
+
+/* With a bad CRC the node alarm goes out every HEARTBEAT_PERIOD seconds
+   at first, then twice as long between each one up to HEARTBEAT_MAX.
+   Neither can be more than 127. */
+#define HEARTBEAT_PERIOD 1
+#define HEARTBEAT_MAX    64
+#define HEARTBEAT_SECOND ((uint16_t)(BOOT_F_CPU / 1024)) /* Timer 1 ticks */
+
+/* The MinSize build configuration defines BL_MINSIZE.  It keeps the CAN
+   protocol and the CRC but turns off everything else so that the
+   bootloader fits in a 2K boot section on the ATmega328P (BOOTSZ = 01,
+   .text at word address 0x3C00).  The last page of that is where the
+   CRC goes so the bootloader itself only gets 1920 bytes, see
+   minsize.ld.  spi_write() comes from util.S instead
+   of cutil.c.  The application has to define BL_MINSIZE too before it
+   includes boot_util.h. */
+#ifdef BL_MINSIZE
+  #undef UART_DEBUG
+  #undef BL_STATS
+  #undef BL_MERGE
+  #undef BL_CANQ
+  #undef BL_FLASHCRC
+  #undef BL_PACING
+  #undef BL_CRC_CHECK
+  #undef BL_EEPROM
+  #undef BL_READ_FILL
+  #undef BL_TRACE
+  #undef BL_STACK_PAINT
+  #undef BL_SESSION_LOG
+  #undef BL_SELFTEST
+  #undef CAN_AUTOBAUD
+  #undef CAN_AUTOBAUD_SAVE
+#endif
+
+/* Uncomment CLOCK_BOOST if the fuses divide the clock down (CKDIV8 or a
+   prescaler set by the application) and set it to the division.  F_CPU
+   stays the clock that the application runs at.  The bootloader sets the
+   prescaler to 1 when it starts, runs everything at BOOT_F_CPU and puts
+   the prescaler back before it starts the application. */
+//#define CLOCK_BOOST 8
+#ifdef CLOCK_BOOST
+  #define BOOT_F_CPU (F_CPU * CLOCK_BOOST)
+  #if CLOCK_BOOST == 2
+    #define CLOCK_BOOST_PS 1 /* CLKPS bits of the divided clock */
+  #elif CLOCK_BOOST == 4
+    #define CLOCK_BOOST_PS 2
+  #elif CLOCK_BOOST == 8
+    #define CLOCK_BOOST_PS 3
+  #elif CLOCK_BOOST == 16
+    #define CLOCK_BOOST_PS 4
+  #else
+    #error CLOCK_BOOST has to be 2, 4, 8 or 16
+  #endif
+  /* Timer 1 ticks to wait for a firmware update after reset, one second */
+  #define BOOT_WAIT ((uint16_t)(BOOT_F_CPU / 1024))
+#else
+  #define BOOT_F_CPU F_CPU
+  #define BOOT_WAIT 0x2B00 /* About a second at 11.0592MHz */
+#endif
 
 #ifdef __AVR_ATmega328P__
   #define PGM_PAGE_SIZE 128 /* Page size in Bytes */
@@ -37,6 +160,8 @@
   #define PGM_LENGTH_BITS 16          /* Changes how we read and write to flash */
   #define PGM_LENGTH (const uint16_t *)0x7FFC /* The address where the program size is located */
   #define PGM_CRC    (const uint16_t *)0x7FFE /* The address where the programs checksum is located */
+  #define UART_UDRE_vect     USART_UDRE_vect
+  #define UART_UDRE_vect_num USART_UDRE_vect_num
 #endif
 
 #ifdef __AVR_ATmega2561__
@@ -47,6 +172,8 @@
   #define PGM_LENGTH_LSB (const uint32_t *)0x3EFFA /* The address where the program size is located */
   #define PGM_LENGTH_MSB (const uint32_t *)0x3EFFC /* The address where the program size is located */
   #define PGM_CRC        (const uint16_t *)0x3EFFE /* The address where the programs checksum is located */
+  #define UART_UDRE_vect     USART0_UDRE_vect
+  #define UART_UDRE_vect_num USART0_UDRE_vect_num
 #endif
 
 #endif
@@ -16,12 +16,55 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  *
  *  This file contains the source code for the CANBus interface functions
+ *  for the MCP2515.  can_mcp2517fd.c has the same functions for the
+ *  MCP2517FD.  See can.h for how to pick between them.
  */
 
 #include <string.h>
+#include <avr/pgmspace.h>
+#include <avr/boot.h>
 #include "can.h"
 #include "util.h"
-#include "mcp2515.h"
+#include "stats.h"
+#include "log.h"
+
+#ifndef CAN_MCP2517FD
+
+/* MCP2515 bit timing registers for each of the BITRATE_xxx values.
+   These are worked out at compile time from MCP2515_OSC.  Rates that
+   can't be made from the oscillator are all zero. */
+#define CNF_ENTRY(rate) { CAN_TIMING_CNF1(rate), CAN_TIMING_CNF2(rate), CAN_TIMING_CNF3(rate) }
+static const uint8_t cnf_table[BITRATE_COUNT][3] PROGMEM = {
+    CNF_ENTRY(125000UL),  /* BITRATE_125 */
+    CNF_ENTRY(250000UL),  /* BITRATE_250 */
+    CNF_ENTRY(500000UL),  /* BITRATE_500 */
+    CNF_ENTRY(1000000UL), /* BITRATE_1000 */
+    CNF_ENTRY(50000UL),   /* BITRATE_50 */
+    CNF_ENTRY(100000UL),  /* BITRATE_100 */
+    CNF_ENTRY(800000UL),  /* BITRATE_800 */
+};
+#if CAN_NTQ(125000UL) == 0
+  #error "125kbps is the default bit rate but MCP2515_OSC can't make it"
+#endif
+
+/* Looks up the bit timing registers for the given BITRATE_xxx value.
+   These are the first three arguments to can_init().  Returns 0 if the
+   rate is bad or can't be used with our oscillator.  In that case cnf is
+   set for 125k, which is the default. */
+uint8_t
+can_timing(uint8_t rate, uint8_t *cnf)
+{
+    uint8_t n, good = 1;
+
+    if(rate >= BITRATE_COUNT || pgm_read_table(cnf_table, rate*3 + 1) == 0) {
+        rate = BITRATE_125;
+        good = 0;
+    }
+    for(n=0; n<3; n++) {
+        cnf[n] = pgm_read_table(cnf_table, rate*3 + n);
+    }
+    return good;
+}
 
 /* Sets up the MCP2515 chip.  
    Sets the CNFx registers according to the arguments.
@@ -51,34 +94,109 @@ can_init(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, uint8_t iflags)
     wb[5]=iflags;
 	spi_write(wb,rb,6);
 
+    /* Set to Rx Standard Frames only and rollover - RXB0CTRL.  With
+       rollover a frame that comes in while buffer 0 is full goes to
+       buffer 1 so buffer 0 always has the older frame. */
     wb[1]=CAN_RXB0CTRL;
-	wb[2]=0x20; /* Set to Rx Standard Frames only - RXB0CTRL */
+	wb[2]=(0x01 << CAN_RXM0) | (0x01 << CAN_BUKT);
 	spi_write(wb,rb,3);
 
-    /* Set to Rx Standard Frames only and rollover- RXB1CTRL */
+    /* Set to Rx Standard Frames only - RXB1CTRL */
     wb[1]=CAN_RXB1CTRL;
-    wb[2]=(0x01 << CAN_RXM0) || (0x01 << CAN_BUKT);
+    wb[2]=(0x01 << CAN_RXM0);
     spi_write(wb,rb,3);
 
     /* Put the chip in Normal Mode */
     can_mode(CAN_MODE_NORMAL, 0);
 }
 
+/* Writes the bit timing registers without resetting the chip or
+   changing the interrupt enables.  The MCP2515 has to be in
+   configuration mode for the CNFx registers to be writable. */
+void
+can_bitrate(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3)
+{
+    uint8_t wb[5];
+    uint8_t rb[5];
 
-/* This reads the interrupt flags from the MCP2515 */
-uint8_t
-can_poll_int(void)
+    wb[0]=CAN_WRITE;
+    wb[1]=CAN_CNF3;
+    wb[2]=cnf3;
+    wb[3]=cnf2;
+    wb[4]=cnf1;
+    spi_write(wb,rb,5);
+}
+
+
+/* Reads a single MCP2515 register.  The receive and transmit paths
+   share this and can_modify_reg() so there is only one copy of each. */
+static uint8_t
+can_read_reg(uint8_t reg)
 {
     uint8_t wb[3];
     uint8_t rb[3];
     
 	wb[0]=CAN_READ;
-	wb[1]=CAN_CANINTF;
+	wb[1]=reg;
     spi_write(wb,rb,3);
 
 	return rb[2];
 }
 
+/* Sets the bits given in mask of a single register to value with the
+   Bit Modify command */
+static void
+can_modify_reg(uint8_t reg, uint8_t mask, uint8_t value)
+{
+    uint8_t wb[4];
+    uint8_t rb[4];
+
+    wb[0]=CAN_BIT_MODIFY;
+    wb[1]=reg;
+    wb[2]=mask;
+    wb[3]=value;
+    spi_write(wb,rb,4);
+}
+
+/* This reads the interrupt flags from the MCP2515 */
+uint8_t
+can_poll_int(void)
+{
+	return can_read_reg(CAN_CANINTF);
+}
+
+/* Clears the interrupt flags given in mask */
+void
+can_clear_int(uint8_t mask)
+{
+    can_modify_reg(CAN_CANINTF, mask, 0x00);
+}
+
+/* Reads the transmit and receive error counters into counts[0] and
+   counts[1].  They go up when the bus has trouble and back down as
+   frames get through. */
+void
+can_errors(uint8_t *counts)
+{
+    uint8_t wb[4];
+    uint8_t rb[4];
+
+    wb[0]=CAN_READ;
+    wb[1]=CAN_TEC; /* CAN_REC is right after it */
+    spi_write(wb,rb,4);
+    counts[0] = rb[2];
+    counts[1] = rb[3];
+}
+
+/* Returns the TXBxCTRL register for txbuff.  CAN_TXREQ is set until the
+   frame is gone and CAN_MLOA and CAN_TXERR say whether it lost
+   arbitration or had an error on the way. */
+uint8_t
+can_tx_status(uint8_t txbuff)
+{
+    return can_read_reg((txbuff + 3) << 4);
+}
+
 /* Read the data out of the given buffer and reset the interrupt flag 
    associated with that buffer. rxbuff is the buffer that we want to
    read.  It can be 0 or 1. */
@@ -102,14 +220,43 @@ can_read(uint8_t rxbuff, struct CanFrame *frame)
     frame->id |= rb[3]>>5;
     frame->length = rb[6];
     memcpy(frame->data, &rb[7], frame->length);
+    STAT_INC(rx_frames);
 
     /* Reset the interrupt flag with Bit Modify Command */
-    wb[0]=CAN_BIT_MODIFY;
-    wb[1]=CAN_CANINTF;
-    wb[2]=mask;
-    wb[3]=0x00;
-    spi_write(wb,rb,4);
+    can_clear_int(mask);
+}
+
+#ifdef BL_READ_FILL
+/* can_read() for the buffer data frames while we load firmware.  The
+   Read RX Buffer instruction clears the interrupt flag when CS goes high
+   so this is one SPI transaction instead of two.  The data goes from
+   the SPI buffer straight into the SPM page buffer at address and frame
+   only gets the id and length.  A frame that isn't from id is read the
+   same as can_read() would. */
+void
+can_read_fill(uint8_t rxbuff, struct CanFrame *frame, uint32_t address, uint16_t id)
+{
+    uint8_t wb[14];
+    uint8_t rb[14];
+    uint8_t n;
+
+    wb[0] = rxbuff == 0 ? CAN_READ_RX_BUFFER_0 : CAN_READ_RX_BUFFER_1;
+    spi_write(wb, rb, 14);
+    frame->id =  rb[1]<<3;
+    frame->id |= rb[2]>>5;
+    frame->length = rb[5] & 0x0F;
+    if(frame->length > 8) frame->length = 8;
+    if(frame->id != id) {
+        memcpy(frame->data, &rb[6], frame->length);
+        STAT_INC(rx_frames);
+        return;
+    }
+    for(n=0; n<frame->length; n+=2) {
+        SPM_ATOMIC(boot_page_fill_safe(address+n, rb[6+n] | rb[7+n]<<8));
+    }
+    STAT_INC(rx_frames);
 }
+#endif
 
 /* Send a CAN frame using the transmit buffer given by txbuff 
    txbuff can be 0, 1 or 2.  Any other values and bad things
@@ -122,10 +269,10 @@ can_send(uint8_t txbuff, uint8_t priority, struct CanFrame frame)
     uint8_t rb[16];
 
     /* First we read the TXREQ flag from the given TX buffer */
-    wb[0] = CAN_READ;
-    wb[1] = (txbuff + 3) << 4; /* Calculates the TXBxCTRL register address */
-    spi_write(wb,rb,3);
-    if(rb[2] & (1 << CAN_TXREQ)) return 1;
+    if(can_read_reg((txbuff + 3) << 4) & (1 << CAN_TXREQ)) { /* TXBxCTRL */
+        STAT_INC(tx_busy);
+        return 1;
+    }
 
     wb[0] = CAN_WRITE;
     wb[1] = (txbuff + 3) << 4; /* Calculates the TXBxCTRL register address */
@@ -152,21 +299,17 @@ can_send(uint8_t txbuff, uint8_t priority, struct CanFrame frame)
 uint8_t
 can_mode(uint8_t mode, uint8_t wait)
 {
-    uint8_t wb[4];
-    uint8_t rb[4];
     if(mode != CAN_MODE_QUERY) {
-        wb[0]=CAN_BIT_MODIFY;
-        wb[1]=CAN_CANCTRL;
-        wb[2]=CAN_MODE_MASK;
-        wb[3]=mode;
-        spi_write(wb,rb,4);
+        can_modify_reg(CAN_CANCTRL, CAN_MODE_MASK, mode);
     } else { /* Query the CAN Mode */
-	    wb[0]=CAN_READ;
-		wb[1]=CAN_CANSTAT;
-		spi_write(wb,rb,3);
-		return rb[2] & CAN_MODE_MASK;
+		return can_read_reg(CAN_CANSTAT) & CAN_MODE_MASK;
+    }
+    /* The mode change doesn't happen until any message that is
+       currently being sent or received is finished. */
+    if(wait) {
+        while(can_mode(CAN_MODE_QUERY, 0) != mode);
+        return mode;
     }
-	/* TODO: Add waiting for mode logic */
     return 0;
 }
 
@@ -174,18 +317,8 @@ can_mode(uint8_t mode, uint8_t wait)
 void
 can_mask(uint8_t rxbuff, uint16_t idmask)
 {
-    uint8_t wb[6];
-    uint8_t rb[6];
-    
-    wb[0]=CAN_WRITE;
-    if(rxbuff==0) {
-        wb[1]=CAN_RXM0SIDH;
-    } else {
-        wb[1]=CAN_RXM1SIDH;
-    }
-	wb[2] = idmask >> 3;  /* RXMxSIDH */
-    wb[3] = idmask << 5;  /* RXMxSIDL */
-    spi_write(wb,rb,4);
+    /* The masks are laid out the same as the filters */
+    can_filter(rxbuff == 0 ? CAN_RXM0SIDH : CAN_RXM1SIDH, idmask);
 }
 
 /* Set the acceptance filter.  There are six filters and they can be
@@ -205,3 +338,5 @@ can_filter(uint8_t regid, uint16_t idfilter)
     wb[3] = idfilter << 5;       /* RXFxSIDL */
     spi_write(wb,rb,4);
 }
+
+#endif /* CAN_MCP2517FD */
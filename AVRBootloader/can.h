@@ -23,21 +23,48 @@
 
 #include <avr/io.h>
 
+/* CAN Controller Selection
+
+   The functions below are the same for every controller but only one
+   backend gets built.  The MCP2515 is the default.  Uncomment
+   CAN_MCP2517FD for boards that have an MCP2517FD or MCP2518FD instead.
+   That one can send CAN FD frames with up to 64 data bytes.  Either way
+   can_poll_int() returns its flags in the MCP2515 CANINTF layout. */
+//#define CAN_MCP2517FD 0x01
+
+#ifdef CAN_MCP2517FD
+  #include "mcp2517fd.h"
+  #define CAN_MAX_DLEN 64
+#else
+  #include "mcp2515.h"
+  #define CAN_MAX_DLEN 8
+#endif
+
 //Bitrate definitions for the can_init() function
 #define BITRATE_125  0
 #define BITRATE_250  1
 #define BITRATE_500  2
 #define BITRATE_1000 3
+#define BITRATE_50   4
+#define BITRATE_100  5
+#define BITRATE_800  6
+#define BITRATE_COUNT 7
 
 struct CanFrame {
     uint16_t id;
 	uint8_t length;
-	uint8_t data[8];
+	uint8_t data[CAN_MAX_DLEN];
 };
 
 void can_init(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, uint8_t iflags);
+uint8_t can_timing(uint8_t rate, uint8_t *cnf);
+void can_bitrate(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3);
 uint8_t can_poll_int(void);
+void can_clear_int(uint8_t mask);
+void can_errors(uint8_t *counts);
+uint8_t can_tx_status(uint8_t txbuff);
 void can_read(uint8_t rxbuff, struct CanFrame *frame);
+void can_read_fill(uint8_t rxbuff, struct CanFrame *frame, uint32_t address, uint16_t id);
 uint8_t can_send(uint8_t txbuff, uint8_t priority, struct CanFrame frame);
 uint8_t can_mode(uint8_t mode, uint8_t wait);
 void can_mask(uint8_t rxbuff, uint16_t idmask);
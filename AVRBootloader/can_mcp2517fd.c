@@ -0,0 +1,443 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the source code for the CANBus interface functions
+ *  for the MCP2517FD and MCP2518FD.  These are the same functions that are
+ *  in can.c for the MCP2515.  See can.h for how to pick between them.
+ */
+
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <avr/boot.h>
+#include "can.h"
+#include "util.h"
+#include "stats.h"
+#include "log.h"
+
+#ifdef CAN_MCP2517FD
+
+/* Nominal bit timing for each of the BITRATE_xxx values.  These are the
+   C1NBTCFG prescaler, TSEG1 and TSEG2 bytes.  See mcp2517fd.h */
+#define CNF_ENTRY(rate) { CAN_TIMING_CNF1(rate), CAN_TIMING_CNF2(rate), CAN_TIMING_CNF3(rate) }
+static const uint8_t cnf_table[BITRATE_COUNT][3] PROGMEM = {
+    CNF_ENTRY(125000UL),  /* BITRATE_125 */
+    CNF_ENTRY(250000UL),  /* BITRATE_250 */
+    CNF_ENTRY(500000UL),  /* BITRATE_500 */
+    CNF_ENTRY(1000000UL), /* BITRATE_1000 */
+    CNF_ENTRY(50000UL),   /* BITRATE_50 */
+    CNF_ENTRY(100000UL),  /* BITRATE_100 */
+    CNF_ENTRY(800000UL),  /* BITRATE_800 */
+};
+#if FD_BRP(125000UL, 320) == 0
+  #error "125kbps is the default bit rate but MCP2517FD_OSC can't make it"
+#endif
+#if FD_DBRP == 0
+  #error "CAN_FD_DATA_RATE can't be made from MCP2517FD_OSC"
+#endif
+
+/* Data lengths for each of the 16 DLC codes */
+static const uint8_t dlc_table[16] PROGMEM = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+/* Reads or writes size bytes starting at the given address in the
+   controller.  cmd is FD_READ or FD_WRITE.  wb and rb have to have room
+   for the two command bytes in front of the data. */
+static void
+fd_xfer(uint8_t cmd, uint16_t addr, uint8_t *wb, uint8_t *rb, uint8_t size)
+{
+    wb[0] = cmd | (addr >> 8);
+    wb[1] = addr & 0xFF;
+    spi_write(wb, rb, size + 2);
+}
+
+/* Writes a single byte of one of the 32 bit registers. */
+static void
+fd_write_byte(uint16_t addr, uint8_t value)
+{
+    uint8_t wb[3];
+    uint8_t rb[3];
+
+    wb[2] = value;
+    fd_xfer(FD_WRITE, addr, wb, rb, 1);
+}
+
+/* Reads a single byte of one of the 32 bit registers. */
+static uint8_t
+fd_read_byte(uint16_t addr)
+{
+    uint8_t wb[3];
+    uint8_t rb[3];
+
+    fd_xfer(FD_READ, addr, wb, rb, 1);
+    return rb[2];
+}
+
+/* Returns the SPI address of the next object in the given FIFO.  The
+   user address register is an offset into the message RAM. */
+static uint16_t
+fd_fifo_address(uint8_t fifo)
+{
+    uint8_t wb[4];
+    uint8_t rb[4];
+
+    fd_xfer(FD_READ, FD_C1FIFOUA(fifo), wb, rb, 2);
+    return FD_RAM + (rb[2] | (rb[3] << 8));
+}
+
+/* Looks up the bit timing registers for the given BITRATE_xxx value.
+   These are the first three arguments to can_init().  Returns 0 if the
+   rate is bad or can't be used with our oscillator.  In that case cnf is
+   set for 125k, which is the default. */
+uint8_t
+can_timing(uint8_t rate, uint8_t *cnf)
+{
+    uint8_t n, good = 1;
+
+    if(rate >= BITRATE_COUNT || pgm_read_table(cnf_table, rate*3 + 1) == 0) {
+        rate = BITRATE_125;
+        good = 0;
+    }
+    for(n=0; n<3; n++) {
+        cnf[n] = pgm_read_table(cnf_table, rate*3 + n);
+    }
+    return good;
+}
+
+/* Sets up the MCP2517FD chip.
+   cnf1, cnf2 and cnf3 are the nominal prescaler, TSEG1 and TSEG2.  The
+   data phase timing comes from CAN_FD_DATA_RATE.
+   iflags are the MCP2515 CANINTE bits and are mapped to the closest
+   MCP2517FD interrupts.
+   Transmit FIFOs 1-3 and receive FIFO 4 are set up for 64 byte payloads.
+   Filter 0 accepts all standard frames into the receive FIFO.
+   Put the chip in 'Normal' (mixed CAN FD and CAN 2.0) mode.
+
+   This function is exported with the jump table.  See
+   boot_util.h and util.S.
+*/
+void
+can_init(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, uint8_t iflags)
+{
+    uint8_t wb[6];
+    uint8_t rb[6];
+    uint8_t n;
+
+    /* Reset the MCP2517FD.  It comes out of reset in configuration mode
+       but we have to wait for the oscillator before we can talk to it. */
+    wb[0] = FD_RESET;
+    wb[1] = 0x00;
+    spi_write(wb, rb, 2);
+    while(!(fd_read_byte(FD_OSC + 1) & (1<<FD_OSCRDY)));
+
+    /* Nominal and data bit timing */
+    can_bitrate(cnf1, cnf2, cnf3);
+    wb[2] = FD_DTSEG2 - 1;   /* DSJW */
+    wb[3] = FD_DTSEG2 - 1;
+    wb[4] = FD_DTSEG1 - 1;
+    wb[5] = FD_DBRP - 1;
+    fd_xfer(FD_WRITE, FD_C1DBTCFG, wb, rb, 4);
+    /* Transmitter delay compensation.  The offset goes at the sample point */
+    wb[2] = 0x00;
+    wb[3] = FD_DBRP * FD_DTSEG1;
+    wb[4] = FD_TDCMOD_AUTO;
+    fd_xfer(FD_WRITE, FD_C1TDC, wb, rb, 3);
+
+    /* We don't use the TX queue or the TX event FIFO */
+    fd_write_byte(FD_C1CON + 2, 0x00);
+
+    /* Transmit FIFOs, one message deep each */
+    for(n=0; n<3; n++) {
+        wb[2] = (1<<FD_TXEN);
+        wb[3] = 0x00;
+        wb[4] = FD_TXAT_UNLIMITED;
+        wb[5] = FD_PLSIZE_64;
+        fd_xfer(FD_WRITE, FD_C1FIFOCON(FD_TX_FIFO(n)), wb, rb, 4);
+    }
+    /* Receive FIFO with the not empty interrupt so that RXIF works */
+    wb[2] = (1<<FD_TFNRFNIE);
+    wb[3] = 0x00;
+    wb[4] = 0x00;
+    wb[5] = FD_PLSIZE_64 | (FD_RX_DEPTH - 1);
+    fd_xfer(FD_WRITE, FD_C1FIFOCON(FD_RX_FIFO), wb, rb, 4);
+
+    /* Standard frames only, nothing masked */
+    can_mask(0, 0x0000);
+    can_filter(CAN_RXF0SIDH, 0x0000);
+
+    /* Interrupt enables */
+    wb[2] = 0x00;
+    wb[3] = 0x00;
+    wb[4] = 0x00;
+    wb[5] = 0x00;
+    if(iflags & ((1<<CAN_RX0IF) | (1<<CAN_RX1IF))) wb[4] |= (1<<FD_RXIE);
+    if(iflags & ((1<<CAN_TX0IF) | (1<<CAN_TX1IF) | (1<<CAN_TX2IF))) wb[4] |= (1<<FD_TXIE);
+    if(iflags & (1<<CAN_ERRIF)) wb[5] |= (1<<FD_CERRIE);
+    if(iflags & (1<<CAN_MERRF)) wb[5] |= (1<<FD_IVMIE);
+    fd_xfer(FD_WRITE, FD_C1INT, wb, rb, 4);
+
+    /* Put the chip in Normal Mode */
+    can_mode(CAN_MODE_NORMAL, 0);
+}
+
+/* Writes the nominal bit timing register without resetting the chip.
+   SJW is made the same as TSEG2.  The MCP2517FD has to be in
+   configuration mode for this to work. */
+void
+can_bitrate(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3)
+{
+    uint8_t wb[6];
+    uint8_t rb[6];
+
+    wb[2] = cnf3; /* SJW */
+    wb[3] = cnf3;
+    wb[4] = cnf2;
+    wb[5] = cnf1;
+    fd_xfer(FD_WRITE, FD_C1NBTCFG, wb, rb, 4);
+}
+
+/* This reads the interrupt flags from the MCP2517FD and returns them in
+   the same layout as the MCP2515 CANINTF register.  All received frames
+   show up in receive buffer 0. */
+uint8_t
+can_poll_int(void)
+{
+    uint8_t wb[4];
+    uint8_t rb[4];
+    uint8_t result = 0;
+
+    fd_xfer(FD_READ, FD_C1INT, wb, rb, 2);
+    if(rb[2] & (1<<FD_RXIF)) result |= (1<<CAN_RX0IF);
+    if(rb[2] & (1<<FD_TXIF)) result |= (1<<CAN_TX0IF);
+    if(rb[3] & (1<<FD_CERRIF)) result |= (1<<CAN_ERRIF);
+    if(rb[3] & (1<<FD_IVMIF)) result |= (1<<CAN_MERRF);
+    return result;
+}
+
+/* Clears the interrupt flags given in mask.  The receive flag is only
+   cleared when the FIFO is empty so we throw away what's in it. */
+void
+can_clear_int(uint8_t mask)
+{
+    uint8_t flags = 0xFF;
+
+    if(mask & ((1<<CAN_RX0IF) | (1<<CAN_RX1IF))) {
+        fd_write_byte(FD_C1FIFOCON(FD_RX_FIFO) + 1, (1<<FD_FRESET));
+    }
+    if(mask & (1<<CAN_ERRIF)) flags &= ~(1<<FD_CERRIF);
+    if(mask & (1<<CAN_MERRF)) flags &= ~(1<<FD_IVMIF);
+    /* These flags are cleared by writing zeros to them */
+    fd_write_byte(FD_C1INT + 1, flags);
+}
+
+/* Reads the transmit and receive error counters into counts[0] and
+   counts[1].  C1TREC has the receive counter first. */
+void
+can_errors(uint8_t *counts)
+{
+    uint8_t wb[4];
+    uint8_t rb[4];
+
+    fd_xfer(FD_READ, FD_C1TREC, wb, rb, 2);
+    counts[0] = rb[3];
+    counts[1] = rb[2];
+}
+
+/* Returns the state of the transmit FIFO for txbuff in the MCP2515
+   TXBxCTRL layout.  CAN_TXREQ is set until the FIFO is empty. */
+uint8_t
+can_tx_status(uint8_t txbuff)
+{
+    uint8_t sta, result = 0;
+
+    if(fd_read_byte(FD_C1FIFOCON(FD_TX_FIFO(txbuff)) + 1) & (1<<FD_TXREQ)) result |= (1<<CAN_TXREQ);
+    sta = fd_read_byte(FD_C1FIFOSTA(FD_TX_FIFO(txbuff)));
+    if(sta & (1<<FD_TXLARB)) result |= (1<<CAN_MLOA);
+    if(sta & (1<<FD_TXERR)) result |= (1<<CAN_TXERR);
+    return result;
+}
+
+/* Read the next frame out of the receive FIFO.  rxbuff is ignored since
+   there is only the one FIFO.  The SPI transfers are done in place since
+   spi_write() doesn't care if the read and write buffers are the same. */
+void
+can_read(uint8_t rxbuff, struct CanFrame *frame)
+{
+    uint8_t buff[2 + CAN_MAX_DLEN];
+    uint16_t addr;
+
+    addr = fd_fifo_address(FD_RX_FIFO);
+    /* The two header words and the first eight data bytes */
+    fd_xfer(FD_READ, addr, buff, buff, 16);
+    frame->id = buff[2] | ((buff[3] & 0x07) << 8);
+    frame->length = pgm_read_table(dlc_table, buff[6] & 0x0F);
+    memcpy(frame->data, &buff[10], 8);
+    if(frame->length > 8) { /* The rest of an FD frame */
+        fd_xfer(FD_READ, addr + 16, buff, buff, frame->length - 8);
+        memcpy(&frame->data[8], &buff[2], frame->length - 8);
+    }
+    STAT_INC(rx_frames);
+    /* Tell the FIFO we are done with this one */
+    fd_write_byte(FD_C1FIFOCON(FD_RX_FIFO) + 1, (1<<FD_UINC));
+}
+
+#ifdef BL_READ_FILL
+/* can_read() for the buffer data frames while we load firmware.  The
+   data goes from the SPI buffer straight into the SPM page buffer at
+   address and frame only gets the id and length.  The first eight bytes
+   are filled before the rest of an FD frame is read over them.  A frame
+   that isn't from id is read the same as can_read() would. */
+void
+can_read_fill(uint8_t rxbuff, struct CanFrame *frame, uint32_t address, uint16_t id)
+{
+    uint8_t buff[2 + 8 + CAN_MAX_DLEN];
+    uint16_t addr;
+    uint8_t n;
+
+    addr = fd_fifo_address(FD_RX_FIFO);
+    fd_xfer(FD_READ, addr, buff, buff, 16);
+    frame->id = buff[2] | ((buff[3] & 0x07) << 8);
+    frame->length = pgm_read_table(dlc_table, buff[6] & 0x0F);
+    if(frame->id != id) {
+        memcpy(frame->data, &buff[10], 8);
+    } else {
+        for(n=0; n<frame->length && n<8; n+=2) {
+            SPM_ATOMIC(boot_page_fill_safe(address+n, buff[10+n] | buff[11+n]<<8));
+        }
+    }
+    if(frame->length > 8) {
+        fd_xfer(FD_READ, addr + 16, buff, buff, frame->length - 8);
+        if(frame->id != id) {
+            memcpy(&frame->data[8], &buff[2], frame->length - 8);
+        } else {
+            for(n=0; n<frame->length - 8; n+=2) {
+                SPM_ATOMIC(boot_page_fill_safe(address+8+n, buff[2+n] | buff[3+n]<<8));
+            }
+        }
+    }
+    STAT_INC(rx_frames);
+    fd_write_byte(FD_C1FIFOCON(FD_RX_FIFO) + 1, (1<<FD_UINC));
+}
+#endif
+
+/* Send a CAN frame using the transmit FIFO for txbuff.  txbuff can be
+   0, 1 or 2.  Frames longer than 8 bytes are sent as CAN FD frames with
+   bit rate switching.  The data is padded with zeros up to the next FD
+   length.  Returns 0 on success and 1 if the FIFO is still full from
+   a previous transmission. */
+uint8_t
+can_send(uint8_t txbuff, uint8_t priority, struct CanFrame frame)
+{
+    uint8_t buff[2 + 8 + CAN_MAX_DLEN];
+    uint8_t dlc = 0, length;
+    uint16_t addr;
+
+    if(!(fd_read_byte(FD_C1FIFOSTA(FD_TX_FIFO(txbuff))) & (1<<FD_TFNRFNIF))) {
+        STAT_INC(tx_busy);
+        return 1;
+    }
+
+    if(frame.length > CAN_MAX_DLEN) frame.length = CAN_MAX_DLEN;
+    while(pgm_read_table(dlc_table, dlc) < frame.length) dlc++;
+    length = pgm_read_table(dlc_table, dlc);
+
+    buff[2] = frame.id & 0xFF;     /* T0 - SID */
+    buff[3] = (frame.id >> 8) & 0x07;
+    buff[4] = 0x00;
+    buff[5] = 0x00;
+    buff[6] = dlc;                 /* T1 - DLC and flags */
+    if(dlc > 8) buff[6] |= (1<<FD_OBJ_FDF) | (1<<FD_OBJ_BRS);
+    buff[7] = 0x00;
+    buff[8] = 0x00;
+    buff[9] = 0x00;
+    memcpy(&buff[10], frame.data, frame.length);
+    memset(&buff[10 + frame.length], 0x00, length - frame.length);
+
+    addr = fd_fifo_address(FD_TX_FIFO(txbuff));
+    fd_xfer(FD_WRITE, addr, buff, buff, 8 + length);
+
+    /* Set the priority then move the FIFO along and request the send */
+    fd_write_byte(FD_C1FIFOCON(FD_TX_FIFO(txbuff)) + 2, FD_TXAT_UNLIMITED | (priority & 0x1F));
+    fd_write_byte(FD_C1FIFOCON(FD_TX_FIFO(txbuff)) + 1, (1<<FD_UINC) | (1<<FD_TXREQ));
+
+    return 0;
+}
+
+/* Put the MCP2517FD into the given mode. If mode = CAN_MODE_QUERY
+   the current mode of the chip will be read and returned. If
+   wait is set then the function will continuously poll the
+   chip until it's in the proper mode and the mode will be returned. */
+uint8_t
+can_mode(uint8_t mode, uint8_t wait)
+{
+    if(mode != CAN_MODE_QUERY) {
+        fd_write_byte(FD_C1CON + FD_REQOP_BYTE, mode);
+    } else { /* Query the CAN Mode */
+        return (fd_read_byte(FD_C1CON + FD_OPMOD_BYTE) >> 5) & CAN_MODE_MASK;
+    }
+    if(wait) {
+        while(can_mode(CAN_MODE_QUERY, 0) != mode);
+        return mode;
+    }
+    return 0;
+}
+
+/* Set the acceptance mask.  The MCP2517FD has a mask for every filter so
+   this sets the masks for the filters that go with the given MCP2515
+   receive buffer.  Filters 0 and 1 for buffer 0 and 2-5 for buffer 1.
+   The mask always includes the IDE bit so only standard frames match. */
+void
+can_mask(uint8_t rxbuff, uint16_t idmask)
+{
+    uint8_t wb[6];
+    uint8_t rb[6];
+    uint8_t n, last;
+
+    if(rxbuff==0) {
+        n = 0; last = 1;
+    } else {
+        n = 2; last = 5;
+    }
+    for(; n<=last; n++) {
+        wb[2] = idmask & 0xFF;
+        wb[3] = (idmask >> 8) & 0x07;
+        wb[4] = 0x00;
+        wb[5] = (1<<FD_MIDE);
+        fd_xfer(FD_WRITE, FD_C1MASK(n), wb, rb, 4);
+    }
+}
+
+/* Set the acceptance filter and point it at the receive FIFO.  regid is
+   the filter number 0-5.  The CAN_RXFxSIDH names in mcp2517fd.h are the
+   same numbers so code written for the MCP2515 still works. */
+void
+can_filter(uint8_t regid, uint16_t idfilter)
+{
+    uint8_t wb[6];
+    uint8_t rb[6];
+
+    /* The filter can only be changed while it's turned off */
+    fd_write_byte(FD_C1FLTCON(regid), 0x00);
+    wb[2] = idfilter & 0xFF;
+    wb[3] = (idfilter >> 8) & 0x07;
+    wb[4] = 0x00;
+    wb[5] = 0x00;
+    fd_xfer(FD_WRITE, FD_C1FLTOBJ(regid), wb, rb, 4);
+    fd_write_byte(FD_C1FLTCON(regid), (1<<FD_FLTEN) | FD_RX_FIFO);
+}
+
+#endif /* CAN_MCP2517FD */
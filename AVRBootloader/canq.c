@@ -0,0 +1,158 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Interrupt driven CAN queues for the application.  See canq.h
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "bootloader.h"
+#include "canq.h"
+#include "util.h"
+
+#ifdef BL_CANQ
+
+/* The filter registers in the order that canq_filter() takes them.  This
+   can't be in SRAM because the application never runs our .data setup. */
+static const uint8_t filter_regs[6] PROGMEM = {CAN_RXF0SIDH, CAN_RXF1SIDH, CAN_RXF2SIDH,
+                                               CAN_RXF3SIDH, CAN_RXF4SIDH, CAN_RXF5SIDH};
+
+/* Sets up the queues.  rx and tx are arrays of rx_size and tx_size
+   frames in the application's SRAM.  Interrupts should be off until
+   this returns. */
+void
+canq_init(struct CanQueue *q, struct CanFrame *rx, uint8_t rx_size,
+          struct CanFrame *tx, uint8_t tx_size)
+{
+    q->rx = rx;
+    q->tx = tx;
+    q->rx_size = rx_size;
+    q->tx_size = tx_size;
+    q->rx_head = q->rx_tail = 0;
+    q->tx_head = q->tx_tail = 0;
+    q->rx_overruns = 0;
+    q->rx1_older = 0;
+}
+
+/* Sets the receive masks and all six filters.  ids[0] and ids[1] go with
+   mask0 and ids[2] through ids[5] with mask1, the same as the MCP2515's
+   receive buffers.  Set a mask to 0 to let everything in. */
+void
+canq_filter(uint16_t mask0, uint16_t mask1, const uint16_t *ids)
+{
+    uint8_t n, sreg = SREG;
+
+    cli();
+    can_mode(CAN_MODE_CONFIG, 1);
+    can_mask(0, mask0);
+    can_mask(1, mask1);
+    for(n=0; n<6; n++) {
+        can_filter(pgm_read_table(filter_regs, n), ids[n]);
+    }
+    can_mode(CAN_MODE_NORMAL, 1);
+    SREG = sreg;
+}
+
+/* Gives the controller the next frame from the transmit queue if its
+   buffer is free.  Has to be called with interrupts off. */
+static void
+tx_next(struct CanQueue *q)
+{
+    if(q->tx_tail == q->tx_head) return;
+    if(can_send(0, 0, q->tx[q->tx_tail]) == 0) {
+        if(++q->tx_tail == q->tx_size) q->tx_tail = 0;
+    }
+}
+
+/* Queues a copy of frame to be sent.  It goes straight to the
+   controller if nothing is waiting ahead of it.  Returns 0 on success
+   and 1 if the queue is full. */
+uint8_t
+canq_send(struct CanQueue *q, const struct CanFrame *frame)
+{
+    uint8_t next, sreg;
+
+    next = q->tx_head + 1;
+    if(next == q->tx_size) next = 0;
+    if(next == q->tx_tail) return 1;
+    q->tx[q->tx_head] = *frame;
+    sreg = SREG;
+    cli(); /* canq_service() uses the SPI too */
+    q->tx_head = next;
+    tx_next(q);
+    SREG = sreg;
+    return 0;
+}
+
+/* Takes the oldest received frame off of the queue.  Returns 0 if there
+   was one and 1 if the queue is empty. */
+uint8_t
+canq_recv(struct CanQueue *q, struct CanFrame *frame)
+{
+    uint8_t tail = q->rx_tail;
+
+    if(tail == q->rx_head) return 1;
+    *frame = q->rx[tail];
+    if(++tail == q->rx_size) tail = 0;
+    q->rx_tail = tail;
+    return 0;
+}
+
+/* Moves a frame from receive buffer rxbuff into the queue.  When the
+   queue is full the frame is still read so the interrupt goes away. */
+static void
+rx_take(struct CanQueue *q, uint8_t rxbuff)
+{
+    uint8_t next = q->rx_head + 1;
+
+    if(next == q->rx_size) next = 0;
+    if(next == q->rx_tail) {
+        struct CanFrame lost;
+        can_read(rxbuff, &lost);
+        q->rx_overruns++;
+        return;
+    }
+    can_read(rxbuff, &q->rx[q->rx_head]);
+    q->rx_head = next;
+}
+
+/* The application calls this from the interrupt for the CAN controller's
+   INT line.  It empties the receive buffers, oldest first the same way
+   that rx_oldest() in main.c does, and keeps the transmit buffer going. */
+void
+canq_service(struct CanQueue *q)
+{
+    uint8_t flags;
+
+    while(1) {
+        flags = can_poll_int();
+        if((flags & (1<<CAN_RX1IF)) && (q->rx1_older || !(flags & (1<<CAN_RX0IF)))) {
+            rx_take(q, 1);
+            q->rx1_older = 0;
+        } else if(flags & (1<<CAN_RX0IF)) {
+            rx_take(q, 0);
+            q->rx1_older = can_poll_int() & (1<<CAN_RX1IF);
+        } else {
+            break;
+        }
+    }
+    if(flags & (1<<CAN_TX0IF)) can_clear_int(1<<CAN_TX0IF);
+    tx_next(q);
+}
+
+#endif /* BL_CANQ */
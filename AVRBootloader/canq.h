@@ -0,0 +1,67 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Interrupt driven CAN queues for the application.  The bootloader
+ *  doesn't use these itself, they are only here so that every
+ *  application doesn't need its own copy.  They are exported with the
+ *  jump table, see boot_util.h and util.S.
+ *
+ *  The bootloader's SRAM belongs to the application once it's running so
+ *  everything is kept in a struct CanQueue and the frame buffers that the
+ *  application gives us.  The application hooks the pin that the CAN
+ *  controller's INT line is wired to and calls canq_service() from that
+ *  interrupt.  It should be a low level interrupt because the line stays
+ *  low until every flag is cleared.  can_init() has to be called first
+ *  with the receive interrupts turned on in iflags, and (1<<CAN_TX0IF) as
+ *  well on the MCP2515.  The MCP2517FD's transmit interrupt stays on as
+ *  long as the FIFO has room so leave it off there.  canq_service()
+ *  doesn't clear the error interrupts so leave those off too.
+ *
+ *  After canq_init() the queues are the only thing that should use the
+ *  CAN controller since canq_service() can run in the middle of anything
+ *  else.  Transmit buffer 0 is the only one we use.
+ */
+
+#ifndef _BL_CANQ_H
+#define _BL_CANQ_H
+
+#include "can.h"
+
+/* The indexes are changed by the interrupt so they're volatile.  Each
+   queue holds one less frame than its size so that full and empty look
+   different. */
+struct CanQueue {
+    struct CanFrame *rx;
+    struct CanFrame *tx;
+    uint8_t rx_size;
+    volatile uint8_t rx_head;     /* Where canq_service() puts the next frame */
+    volatile uint8_t rx_tail;     /* Where canq_recv() gets the next frame */
+    uint8_t tx_size;
+    volatile uint8_t tx_head;     /* Where canq_send() puts the next frame */
+    volatile uint8_t tx_tail;     /* The next frame to go to the controller */
+    volatile uint8_t rx_overruns; /* Frames we threw away because rx was full */
+    uint8_t rx1_older;            /* See rx_oldest() in main.c */
+};
+
+void canq_init(struct CanQueue *q, struct CanFrame *rx, uint8_t rx_size,
+               struct CanFrame *tx, uint8_t tx_size);
+void canq_filter(uint16_t mask0, uint16_t mask1, const uint16_t *ids);
+uint8_t canq_send(struct CanQueue *q, const struct CanFrame *frame);
+uint8_t canq_recv(struct CanQueue *q, struct CanFrame *frame);
+void canq_service(struct CanQueue *q);
+
+#endif
@@ -20,7 +20,11 @@
  */
 
 #include <avr/io.h>
+#include "bootloader.h"
 #include "util.h"
+#include "stats.h"
+
+#ifndef BL_MINSIZE
 
 /* Busy loop SPI write.  Takes the contents of *write_buff
    and sends each bit out the SPI port in turn.  Receives each
@@ -46,6 +50,8 @@ spi_write(uint8_t *write_buff, uint8_t *read_buff, uint8_t size)
         ptr++;
     }
     SPI_SS_HIGH();
+    STAT_INC(spi);
 	TCNT0 = 0;          /* Reset Timer/Counter */
 	TIFR0 |= (1<<TOV0); /* Reset Timer Overflow Flag */
 }
+#endif /* BL_MINSIZE */
@@ -26,5 +26,23 @@
 /* Node Specific Message Command Codes */
 #define FIX_FIRMWARE  7
 
+/* Bootloader specific codes are at the top of the range.
+   FIX_BL_STATS asks for the performance counters.  data[2] is the byte
+   offset into the counter block and the response has as much of the
+   block from there as will fit after the same three bytes. */
+#define FIX_BL_STATS  0xF0
+
+/* FIX_BL_STACK works the same way for the stack high water mark and
+   the stack used by each exported function.  See stack.h */
+#define FIX_BL_STACK  0xF1
+
+/* FIX_BL_LOG reads the ring of firmware load records in the EEPROM.
+   See session.h */
+#define FIX_BL_LOG    0xF2
+
+/* FIX_BL_SELFTEST runs the loopback self test when data[2] is 0 and
+   reads the results.  See selftest.h */
+#define FIX_BL_SELFTEST 0xF3
+
 
 #endif
@@ -0,0 +1,88 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Flash CRC for the application.  See flashcrc.h
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "bootloader.h"
+#include "flashcrc.h"
+#include "util.h"
+
+#ifdef BL_FLASHCRC
+
+/* The CRC16 (0xA001) of each nibble so a byte only takes two lookups
+   instead of eight shifts.  pgmcrc() on the 2561 builds a whole byte
+   table on the stack but that's 512 bytes of the application's SRAM. */
+static const uint16_t nibble_table[16] PROGMEM = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+static uint16_t
+nibble(uint8_t n)
+{
+    return pgm_read_table(nibble_table, n * 2) | pgm_read_table(nibble_table, n * 2 + 1) << 8;
+}
+
+/* Starts a CRC of the flash from start up to end - 1.  If end is 0 it's
+   from 0 to the end of the firmware that the uploader stored. */
+void
+flashcrc_begin(struct FlashCrc *s, uint32_t start, uint32_t end)
+{
+#if PGM_LENGTH_BITS == 16
+    s->stored = pgm_read_word_near(PGM_CRC);
+    if(end == 0) {
+        start = 0;
+        end = pgm_read_word_near(PGM_LENGTH);
+    }
+#elif PGM_LENGTH_BITS == 32
+    s->stored = pgm_read_word_far(PGM_CRC);
+    if(end == 0) {
+        start = 0;
+        end = pgm_read_dword_far(PGM_LENGTH);
+    }
+#endif
+    /* Same bounds check as main() */
+    if(end > PGM_LAST_PAGE_START + PGM_PAGE_SIZE) end = PGM_LAST_PAGE_START + PGM_PAGE_SIZE;
+    s->next = start;
+    s->end = end;
+    s->crc = 0xFFFF;
+}
+
+/* Adds up to budget more bytes to the CRC.  Each one takes about the
+   same time so the application can pick budget to fit the time it has.
+   Returns 1 if there's more to do and 0 when s->crc is done. */
+uint8_t
+flashcrc_step(struct FlashCrc *s, uint16_t budget)
+{
+    uint32_t addr = s->next;
+    uint16_t crc = s->crc;
+
+    while(budget-- && addr < s->end) {
+        crc ^= pgm_read_app(addr);
+        addr++;
+        crc = (crc >> 4) ^ nibble(crc & 0x0F);
+        crc = (crc >> 4) ^ nibble(crc & 0x0F);
+    }
+    s->next = addr;
+    s->crc = crc;
+    return addr < s->end;
+}
+
+#endif /* BL_FLASHCRC */
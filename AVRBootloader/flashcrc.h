@@ -0,0 +1,46 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Flash CRC for the application.  This is the same CRC16 that pgmcrc()
+ *  checks the firmware with, but it's done a piece at a time so that an
+ *  application can keep checking its flash in its idle time without
+ *  carrying its own copy.  It's exported with the jump table, see
+ *  boot_util.h and util.S.
+ *
+ *  Call flashcrc_begin() with the range and then flashcrc_step() until
+ *  it returns 0.  Everything is kept in the struct FlashCrc so it doesn't
+ *  matter what else the application does in between.  With end = 0 the
+ *  range is the whole firmware the way the uploader sent it and when
+ *  it's done crc should equal stored.
+ */
+
+#ifndef _BL_FLASHCRC_H
+#define _BL_FLASHCRC_H
+
+#include <stdint.h>
+
+struct FlashCrc {
+    uint32_t next;   /* The next address to add */
+    uint32_t end;    /* One past the last address */
+    uint16_t crc;
+    uint16_t stored; /* What the uploader stored at PGM_CRC */
+};
+
+void flashcrc_begin(struct FlashCrc *s, uint32_t start, uint32_t end);
+uint8_t flashcrc_step(struct FlashCrc *s, uint16_t budget);
+
+#endif
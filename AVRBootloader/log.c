@@ -0,0 +1,137 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the interrupt driven UART debug logger.  See log.h
+ *
+ *  The interrupt vector is in util.S.  The bootloader doesn't have a
+ *  vector table of its own.  IVSEL puts the vectors at the start of the
+ *  boot section on top of the jump table, so util.S puts a jmp to the
+ *  handler in the right slot.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "log.h"
+
+#ifdef UART_DEBUG
+
+#define UART_UBRR   ((BOOT_F_CPU + 4 * UART_BAUD) / (8 * UART_BAUD) - 1)
+#define UART_ACTUAL (BOOT_F_CPU / (8 * (UART_UBRR + 1)))
+#if UART_ACTUAL * 100 > UART_BAUD * 102 || UART_ACTUAL * 100 < UART_BAUD * 98
+  #error "UART_BAUD can't be made from BOOT_F_CPU to within 2%"
+#endif
+#if LOG_BUFF_SIZE > 128 || (LOG_BUFF_SIZE & (LOG_BUFF_SIZE - 1))
+  #error "LOG_BUFF_SIZE has to be a power of two no bigger than 128"
+#endif
+
+static uint8_t log_buff[LOG_BUFF_SIZE];
+static volatile uint8_t log_head; /* Where the next character goes */
+static volatile uint8_t log_tail; /* The next character to send */
+
+/* Sends the next character or turns itself off if there aren't any */
+ISR(UART_UDRE_vect)
+{
+    if(log_head == log_tail) {
+        UCSR0B &= ~(1<<UDRIE0);
+        return;
+    }
+    UDR0 = log_buff[log_tail];
+    log_tail = (log_tail + 1) & (LOG_BUFF_SIZE - 1);
+}
+
+static void
+log_putc(char c)
+{
+    uint8_t next = (log_head + 1) & (LOG_BUFF_SIZE - 1);
+
+    if(next == log_tail) return; /* Full */
+    log_buff[log_head] = c;
+    log_head = next;
+    UCSR0B |= (1<<UDRIE0);
+}
+
+/* Sets up the UART at UART_BAUD,8,N,1.  Interrupts have to be enabled
+   for anything to come out. */
+void
+log_init(void)
+{
+    UBRR0H = UART_UBRR >> 8;
+    UBRR0L = UART_UBRR & 0xFF;
+    UCSR0A = (1<<U2X0);
+    UCSR0C = (1<<UCSZ01) | (1<<UCSZ00); /* Set 1 Stop bit no parity */
+    UCSR0B = (1<<RXEN0) | (1<<TXEN0);
+}
+
+/* Waits for everything in the buffer to go out.  For dumps that are
+   bigger than the buffer. */
+void
+log_flush(void)
+{
+    while(UCSR0B & (1<<UDRIE0));
+}
+
+/* Waits for everything in the buffer to go out and turns the UART off.
+   The transmitter finishes the character that it's sending before it
+   goes off.  This has to be done before we leave the bootloader or the
+   application will get our interrupt. */
+void
+log_stop(void)
+{
+    log_flush();
+    UCSR0B = 0;
+}
+
+void
+log_str(const char *str)
+{
+    while(*str) log_putc(*str++);
+}
+
+static void
+log_nibble(uint8_t value)
+{
+    log_putc(value < 10 ? '0' + value : 'A' - 10 + value);
+}
+
+/* Sends the tag and then the value */
+void
+log_hex(const char *tag, uint32_t value)
+{
+    int8_t shift = 28;
+
+    log_str(tag);
+    while(shift > 0 && !(value >> shift)) shift -= 4;
+    for(; shift >= 0; shift -= 4) log_nibble((value >> shift) & 0x0F);
+}
+
+/* A whole line */
+void
+log_rec(const char *tag, uint32_t value)
+{
+    log_hex(tag, value);
+    log_putc('\n');
+}
+
+/* Always two digits */
+void
+log_byte(uint8_t value)
+{
+    log_nibble(value >> 4);
+    log_nibble(value & 0x0F);
+}
+
+#endif /* UART_DEBUG */
@@ -0,0 +1,86 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  UART debug logger.  Everything that is logged goes into a ring buffer
+ *  and the USART Data Register Empty interrupt sends it out, so logging
+ *  never makes the bootloader wait on the UART.  If the buffer fills up
+ *  the rest of the message is thrown away.  Numbers are sent as hex
+ *  with no leading zeros.
+ *
+ *  The LOG_xxx() macros take a level and anything above LOG_LEVEL (see
+ *  bootloader.h) is compiled out.  Without UART_DEBUG they all go away.
+ */
+
+#ifndef _BL_LOG_H
+#define _BL_LOG_H
+
+#include <avr/interrupt.h>
+#include "bootloader.h"
+#include "util.h"
+
+#define LOG_ERROR 1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#ifdef UART_DEBUG
+
+/* The default baud rate is the fastest standard rate that each clock
+   can make to within 2% */
+#ifndef UART_BAUD
+  #if BOOT_F_CPU == 11059200UL
+    #define UART_BAUD 115200UL
+  #elif BOOT_F_CPU == 1000000UL
+    #define UART_BAUD 9600UL
+  #elif BOOT_F_CPU == 2000000UL
+    #define UART_BAUD 19200UL
+  #elif BOOT_F_CPU == 8000000UL || BOOT_F_CPU == 16000000UL
+    #define UART_BAUD 38400UL
+  #else
+    #error F_CPU needs to be properly defined
+  #endif
+#endif
+
+#ifndef LOG_BUFF_SIZE
+  #define LOG_BUFF_SIZE 64 /* Has to be a power of two */
+#endif
+
+void log_init(void);
+void log_flush(void);
+void log_stop(void);
+void log_str(const char *str);
+void log_hex(const char *tag, uint32_t value);
+void log_rec(const char *tag, uint32_t value);
+void log_byte(uint8_t value);
+
+#define LOG_STR(level, str)        do { if((level) <= LOG_LEVEL) log_str(str); } while(0)
+#define LOG_HEX(level, tag, value) do { if((level) <= LOG_LEVEL) log_hex(tag, value); } while(0)
+#define LOG_REC(level, tag, value) do { if((level) <= LOG_LEVEL) log_rec(tag, value); } while(0)
+
+/* The SPM instruction has to come within four cycles of the write to
+   SPMCSR so the logger interrupt can't be allowed in between. */
+#define SPM_ATOMIC(x) do { cli(); x; sei(); } while(0)
+
+#else
+
+#define LOG_STR(level, str)
+#define LOG_HEX(level, tag, value)
+#define LOG_REC(level, tag, value)
+#define SPM_ATOMIC(x) x
+
+#endif /* UART_DEBUG */
+
+#endif
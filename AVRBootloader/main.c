@@ -31,12 +31,24 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
-#include "mcp2515.h"
 #include <util/delay_basic.h>
 #include "bootloader.h"
+#ifdef CLOCK_BOOST
+#include <avr/power.h>
+#endif
 #include "can.h"
 #include "fix.h"
 #include "util.h"
+#include "stats.h"
+#include "trace.h"
+#include "stack.h"
+#include "session.h"
+#include "selftest.h"
+#include "log.h"
+#ifdef BL_STACK_PAINT
+#include "canq.h"
+#include "flashcrc.h"
+#endif
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,55 +56,121 @@ static inline void init(void);
 
 /* Global Variables */
 uint8_t node_id;
+#ifdef BL_STATS
+struct BlStats bl_stats;
+#endif
+#ifdef BL_TRACE
+struct TraceEvent trace_ring[TRACE_SIZE];
+uint8_t trace_head;         /* Where the next event goes */
+uint8_t trace_count;        /* How many events are in the ring */
+uint8_t trace_spm_pending;  /* The end event for the SPM operation in progress */
+#endif
+#ifdef BL_STACK_PAINT
+struct BlStack bl_stack;
+#endif
+#ifdef BL_SELFTEST
+struct SelfTest bl_selftest;
+#endif
 
 
-#ifdef UART_DEBUG
-/* This is a busy wait UART send function.
-   It's mainly for debugging */
-void
-uart_write(char *write_buff, int size)
+#ifdef BL_TRACE
+/* Adds an event to the trace ring.  The oldest one goes if it's full. */
+static void
+trace(uint8_t event)
+{
+    trace_ring[trace_head].event = event;
+    trace_ring[trace_head].time = TCNT1;
+    trace_head = (trace_head + 1) & (TRACE_SIZE - 1);
+    if(trace_count < TRACE_SIZE) trace_count++;
+}
+
+/* This is called right after an erase or write has been started.  The
+   _safe functions wait for the last one so if it hadn't ended yet it
+   has now. */
+static void
+trace_spm(uint8_t start)
+{
+    if(trace_spm_pending) trace(trace_spm_pending);
+    trace(start);
+    trace_spm_pending = start + 1; /* The matching _END */
+}
+
+/* Looks to see if the SPM operation has finished while we were doing
+   other things. */
+static inline void
+trace_spm_check(void)
 {
-    int ptr=0;
-    while(ptr < size) {
-        while(!(UCSR0A & (1<<UDRE0)));
-        UDR0 = write_buff[ptr];
-        ptr++;
+    if(trace_spm_pending && !boot_spm_busy()) {
+        trace(trace_spm_pending);
+        trace_spm_pending = 0;
     }
 }
 
+/* Sends the trace ring on the response channel.  This is the whole
+   response to the Trace Dump command so there is always at least one
+   frame.  frame is the command. */
+static void
+trace_send(struct CanFrame frame)
+{
+    struct TraceEvent *e;
+    uint8_t i = 0, n;
 
-/* Initialize the Serial port to 9600,8,N,1
-   Used for debugging should be removed for
-   production unless there is enough space
-   to leave it for application use in the BL
-   section of the program.
-*/
-void
-init_serial(void)
+    frame.id++;
+    do {
+        for(n = 2; n + 3 <= CAN_MAX_DLEN && i < trace_count; n += 3, i++) {
+            e = &trace_ring[(trace_head - trace_count + i) & (TRACE_SIZE - 1)];
+            frame.data[n] = e->event;
+            frame.data[n+1] = e->time & 0xFF;
+            frame.data[n+2] = e->time >> 8;
+        }
+        frame.data[1] = trace_count - i; /* How many are left */
+        frame.length = n;
+        while(can_send(0, 3, frame)); /* Wait for the buffer to be free */
+    } while(i < trace_count);
+}
+
+#ifdef UART_DEBUG
+/* Logs the trace ring.  One event per line with the code and the time. */
+static void
+trace_print(void)
 {
-    UCSR0B = (1<<RXEN0) | (1<<TXEN0);
-    UCSR0C = (1<<UCSZ01) | (1<<UCSZ00); /* Set 1 Stop bit no parity */
-#if F_CPU == 11059200UL
-    /* 9600 BAUD @ 11.0592 MHz */
-    UBRR0H = 0;
-    UBRR0L = 71;
-#elif F_CPU == 1000000UL
-    UBRR0H = 0;
-    UBRR0L = 12;
-    UCSR0A = (1 << U2X1);
-#elif F_CPU == 2000000UL
-    UBRR0H = 0;
-    UBRR0L = 24;
-    UCSR0A = (1 << U2X1);
-#elif F_CPU == 8000000UL
-	UBRR0H = 0;
-	UBRR0L = 103;
-	UCSR0A = (1 << U2X1);
-#else
-  #error F_CPU needs to be properly defined
+    struct TraceEvent *e;
+    uint8_t i;
+
+    for(i = 0; i < trace_count; i++) {
+        e = &trace_ring[(trace_head - trace_count + i) & (TRACE_SIZE - 1)];
+        LOG_HEX(LOG_INFO, "T", e->event);
+        LOG_REC(LOG_INFO, " ", e->time);
+        log_flush();
+    }
+}
+#endif
+#endif /* BL_TRACE */
+
+#ifdef BL_STACK_PAINT
+/* Measures the exported functions that the bootloader doesn't use
+   itself.  None of these touch the CAN controller. */
+static void
+stack_probe(void)
+{
+    uint8_t b = 0;
+#ifdef BL_CANQ
+    struct CanQueue q;
+    struct CanFrame f;
+
+    STACK_COST(STK_CANQ_INIT, canq_init(&q, &f, 1, &f, 1));
+    STACK_COST(STK_CANQ_RECV, canq_recv(&q, &f));
 #endif
+#ifdef BL_FLASHCRC
+    struct FlashCrc s;
+
+    STACK_COST(STK_FLASHCRC_BEGIN, flashcrc_begin(&s, 0, 1));
+    STACK_COST(STK_FLASHCRC_STEP, flashcrc_step(&s, 1));
+#endif
+    /* Nothing is clocked out with a size of 0 */
+    STACK_COST(STK_SPI_WRITE, spi_write(&b, &b, 0));
 }
-#endif /* UART_DEBUG */
+#endif /* BL_STACK_PAINT */
 
 /* Sets the port pins to the proper directions and initializes
    the registers for the SPI port */
@@ -120,33 +198,90 @@ init_spi()
     x = SPDR;
 }
 
+#ifdef CAN_AUTOBAUD
+/* Listens to the bus at each bit rate in turn until one of them receives
+   a frame without an error.  We start with the rate that we are given so
+   a node with a good EEPROM locks on right away.  A quiet bus gives us
+   nothing to go on so we stop looking as soon as we see one.  Returns
+   the detected rate or 0xFF if we couldn't find one.  Timer 1 has to be
+   running. */
+static uint8_t
+can_autobaud(uint8_t rate)
+{
+    uint8_t cnf[3];
+	uint8_t result, tries;
+	uint16_t start;
+
+    if(rate >= BITRATE_COUNT) rate = BITRATE_125;
+    for(tries=0; tries < BITRATE_COUNT * AUTOBAUD_PASSES; tries++, rate = (rate + 1) % BITRATE_COUNT) {
+		if(!can_timing(rate, cnf)) continue; /* Can't make this one */
+        /* Listen only mode never sends anything so we can't disturb the
+           bus even if we are at the wrong rate. */
+	    can_mode(CAN_MODE_CONFIG, 1);
+		can_bitrate(cnf[0], cnf[1], cnf[2]);
+		can_mode(CAN_MODE_LISTEN, 1);
+		can_clear_int(0xFF);
+
+        result = 0;
+		start = TCNT1;
+		while(result == 0 && (uint16_t)(TCNT1 - start) < AUTOBAUD_WINDOW) {
+		    result = can_poll_int() & ((1<<CAN_RX0IF) | (1<<CAN_RX1IF) | (1<<CAN_MERRF));
+		}
+		if(result == 0) break; /* Quiet bus */
+		if(!(result & (1<<CAN_MERRF))) {
+		    can_mode(CAN_MODE_CONFIG, 1);
+		    return rate; /* Good frame with no errors */
+		}
+	}
+	can_mode(CAN_MODE_CONFIG, 1);
+	return 0xFF;
+}
+#endif
+
 /* Calls the initialization routines */
 static inline void
 init(void)
 { 
-    uint8_t cnf1=0x03, cnf2=0xb6, cnf3=0x04; /* Defaults to 125k */
+    uint8_t cnf[3];
 	uint8_t can_speed = 0;
 
-	init_spi();
- /* Set the CAN speed.  The values for 125k are the defaults so 0 is ignored
-    and bad values also result in 125k */
+#ifdef CLOCK_BOOST
+    /* Everything from here on runs at BOOT_F_CPU.  The timers, the SPI
+       and the UART are all set up for that clock. */
+    clock_prescale_set(clock_div_1);
+#endif
+	STACK_COST(STK_INIT_SPI, init_spi());
+	TCCR1B=0x05; /* Set Timer/Counter 1 to clk/1024 */
+ /* Set the CAN speed. */
     can_speed = eeprom_read_byte(EE_CAN_SPEED);
-	if(can_speed==BITRATE_250) cnf1=0x01;      /* 250kbps */
-	else if(can_speed==BITRATE_500) cnf1=0x00; /* 500kbps */
-	else if(can_speed==BITRATE_1000) { cnf1=0x00; cnf2=0x92; cnf3=0x02; } /* 1Mbps */
+#ifdef CAN_AUTOBAUD
+    {
+        uint8_t detected = can_autobaud(can_speed);
+        if(detected != 0xFF) {
+#ifdef CAN_AUTOBAUD_SAVE
+            if(detected != can_speed) eeprom_write_byte((uint8_t *)EE_CAN_SPEED, detected);
+#endif
+            can_speed = detected;
+        }
+    }
+	TCNT1 = 0x0000; /* Don't count the time we spent listening against the startup time */
+#endif
+    can_timing(can_speed, cnf);
     node_id = eeprom_read_byte(EE_NODE_ID);
 
  /* Initialize the MCP2515 */
-	can_init(cnf1, cnf2, cnf3, 0x00);
+	STACK_COST(STK_CAN_INIT, can_init(cnf[0], cnf[1], cnf[2], 0x00));
 
 #ifdef UART_DEBUG
-	init_serial();
+	log_init();
 #endif
-	TCCR1B=0x05; /* Set Timer/Counter 1 to clk/1024 */
  /* Move the Interrupt Vector table to the Bootloader section */
 	MCUCR = (1<<IVCE);
 	MCUCR = (1<<IVSEL);
 	EICRA = 0x02; /* Set INT0 to falling edge */
+#ifdef UART_DEBUG
+	sei(); /* For the logger.  It's the only interrupt that we use. */
+#endif
 }
 
 /* This function stores the CRC value and the length in the
@@ -157,19 +292,29 @@ void
 store_crc(uint16_t crc, uint16_t length)
 {    
     uint16_t n, i=0;
+    /* The last page write from the uploader could still be going */
+    boot_spm_busy_wait();
     /* Run through the page and store the information that is already there
        in the temporary buffer. */
     for(n=PGM_LAST_PAGE_START; n<(PGM_LAST_PAGE_START + PGM_PAGE_SIZE-4); n+=2) {
         i = pgm_read_word_near(n);
-        boot_page_fill(n, i);
+        SPM_ATOMIC(boot_page_fill(n, i));
     }
     /* Add the length and crc to the buffer and write it out. */
-    boot_page_fill(PGM_LENGTH, length);
-    boot_page_fill(PGM_CRC, crc);
-    boot_page_erase(PGM_LAST_PAGE_START);
+    SPM_ATOMIC(boot_page_fill(PGM_LENGTH, length));
+    SPM_ATOMIC(boot_page_fill(PGM_CRC, crc));
+    TRACE_SPM_CHECK();
+    TRACE(TR_ERASE_START);
+    SPM_ATOMIC(boot_page_erase(PGM_LAST_PAGE_START));
     boot_spm_busy_wait(); 	
-    boot_page_write(PGM_LAST_PAGE_START);
+    TRACE(TR_ERASE_END);
+    TRACE(TR_WRITE_START);
+    SPM_ATOMIC(boot_page_write(PGM_LAST_PAGE_START));
     boot_spm_busy_wait(); 
+    TRACE(TR_WRITE_END);
+    /* The application section can't be read until we do this.  reset()
+       doesn't do it for us and the CRC check is next. */
+    SPM_ATOMIC(boot_rww_enable());
 }
 #elif PGM_LENGTH_BITS == 32
 void
@@ -182,44 +327,433 @@ store_crc(uint16_t crc, uint32_t length)
        in the temporary buffer. */
     for(n=PGM_LAST_PAGE_START; n<(PGM_LAST_PAGE_START + PGM_PAGE_SIZE-6); n+=2) {
         i = pgm_read_word_far(n);
-        boot_page_fill_safe(n, i);
+        SPM_ATOMIC(boot_page_fill_safe(n, i));
     }
     /* Add the length and crc to the buffer and write it out. */
-    boot_page_fill_safe(PGM_LENGTH_LSB, (uint16_t)(length & 0x0000FFFF));
-    boot_page_fill_safe(PGM_LENGTH_MSB, (uint16_t)(length >> 16));
-    boot_page_fill_safe(PGM_CRC, crc);
-    boot_page_erase_safe(PGM_LAST_PAGE_START);
-    boot_page_write_safe(PGM_LAST_PAGE_START);
+    SPM_ATOMIC(boot_page_fill_safe(PGM_LENGTH_LSB, (uint16_t)(length & 0x0000FFFF)));
+    SPM_ATOMIC(boot_page_fill_safe(PGM_LENGTH_MSB, (uint16_t)(length >> 16)));
+    SPM_ATOMIC(boot_page_fill_safe(PGM_CRC, crc));
+    TRACE_SPM_CHECK();
+    TRACE(TR_ERASE_START);
+    SPM_ATOMIC(boot_page_erase_safe(PGM_LAST_PAGE_START));
+    boot_spm_busy_wait();
+    TRACE(TR_ERASE_END);
+    TRACE(TR_WRITE_START);
+    SPM_ATOMIC(boot_page_write_safe(PGM_LAST_PAGE_START));
+    boot_spm_busy_wait();
+    TRACE(TR_WRITE_END);
+    /* The application section can't be read until we do this.  reset()
+       doesn't do it for us and the CRC check is next. */
+    SPM_ATOMIC(boot_rww_enable_safe());
+}
+#endif
+
+#ifdef BL_MERGE
+/* The page that sparse Fill Buffer commands go into.  Whatever they don't
+   change is what was in the flash before. */
+static uint8_t merge_page[PGM_PAGE_SIZE];
+static uint32_t merge_address = 0xFFFFFFFF;
+
+/* Reads the page at address into merge_page unless it's already there */
+static void
+merge_load(uint32_t address)
+{
+    uint16_t n;
+
+    if(address == merge_address) return;
+    /* The application section can't be read while it's being written */
+    SPM_ATOMIC(boot_rww_enable_safe());
+    for(n=0; n<PGM_PAGE_SIZE; n++) {
+        merge_page[n] = pgm_read_app(address + n);
+    }
+    merge_address = address;
+}
+
+/* Erases the page and writes merge_page back into it.  This is the same
+   read/modify/write that store_crc() does but for any page. */
+static void
+merge_write(uint32_t address)
+{
+    uint16_t n;
+
+    merge_load(address);
+    for(n=0; n<PGM_PAGE_SIZE; n+=2) {
+        SPM_ATOMIC(boot_page_fill_safe(address + n, *(uint16_t *)&merge_page[n]));
+    }
+    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_erase_safe(address)));
+    STAT_INC(erases);
+    TRACE_SPM(TR_ERASE_START);
+    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_write_safe(address)));
+    STAT_INC(writes);
+    TRACE_SPM(TR_WRITE_START);
+    merge_address = 0xFFFFFFFF; /* The flash has it now */
+}
+#endif
+
+#ifdef BL_CRC_CHECK
+/* CRC16 of the flash from 0 up to crc_next.  It's worked out a page at a
+   time as the uploader moves on to the next one so that Complete only
+   has the last page left to do. */
+static uint16_t crc_run = 0xFFFF;
+static uint32_t crc_next;
+static uint32_t crc_want;  /* Everything below this is written */
+
+/* Bytes that crc_step() adds each time read_channel() goes around.  A
+   patch can skip a lot of pages and folding all of them at once would
+   hold up our answer to the Fill Buffer for seconds. */
+#define CRC_STEP 8
+
+/* The same CRC16 as pgmcrc() */
+static uint16_t
+crc_byte(uint16_t crc, uint8_t b)
+{
+    uint8_t i = 8;
+
+    crc ^= b;
+    while(i--) {
+        if(crc & 0x0001) crc = (crc >> 1) ^ 0xA001;
+        else crc >>= 1;
+    }
+    return crc;
+}
+
+/* The flash at address is being erased or written.  If crc_run already
+   has it we have to start over, and crc_step() has to stop short of it. */
+static void
+crc_touch(uint32_t address)
+{
+    if(address < crc_next) {
+        crc_run = 0xFFFF;
+        crc_next = 0;
+    }
+    if(address < crc_want) crc_want = address;
+}
+
+/* Adds a few more bytes of the flash below crc_want to crc_run while we
+   wait for frames.  The flash can't be read while it's being written. */
+static void
+crc_step(void)
+{
+    uint8_t n = CRC_STEP;
+
+    if(boot_spm_busy() || boot_rww_busy()) return;
+    while(n-- && crc_next < crc_want) {
+        crc_run = crc_byte(crc_run, pgm_read_app(crc_next));
+        crc_next++;
+    }
+}
+
+/* Adds the flash up to end to crc_run.  Everything below end has to be
+   written and readable. */
+static void
+crc_fold(uint32_t end)
+{
+    crc_touch(end);
+    while(crc_next < end) {
+        crc_run = crc_byte(crc_run, pgm_read_app(crc_next));
+        crc_next++;
+    }
+}
+#endif
+
+#ifdef BL_EEPROM
+/* EEPROM Write data waits here for the EEPROM.  A byte takes about 3.3mS
+   to write so this lets us take the next frames while the last ones are
+   still going in. */
+#define EE_QUEUE 64 /* Has to be a power of two and hold a whole frame */
+static uint8_t ee_queue[EE_QUEUE];
+static uint8_t ee_head;     /* Where the next byte goes */
+static uint8_t ee_count;
+static uint16_t ee_address; /* Where the oldest byte in the queue goes */
+
+/* The last byte that EEPROM Write can change.  The session log is ours. */
+#ifdef BL_SESSION_LOG
+  #define EE_WRITE_END (EE_SESSION_LOG - 1)
+#else
+  #define EE_WRITE_END E2END
+#endif
+
+/* Starts on the next byte if the EEPROM is ready.  Bytes that are
+   already right are skipped without writing them.  The EEPROM can't be
+   written while the flash is, or while the page buffer is being loaded,
+   so Fill Buffer and Merge Write drain the queue before they start. */
+static void
+ee_service(void)
+{
+    uint8_t b;
+
+    while(ee_count && eeprom_is_ready() && !boot_spm_busy()) {
+        b = ee_queue[(uint8_t)(ee_head - ee_count) & (EE_QUEUE-1)];
+        if(ee_address <= EE_WRITE_END && eeprom_read_byte((uint8_t *)(uintptr_t)ee_address) != b) {
+            eeprom_write_byte((uint8_t *)(uintptr_t)ee_address, b);
+        }
+        ee_address++;
+        ee_count--;
+    }
+}
+
+/* Writes everything in the queue and waits for the last one to finish */
+static void
+ee_drain(void)
+{
+    while(ee_count) ee_service();
+    eeprom_busy_wait();
+}
+#endif
+
+#ifdef BL_SESSION_LOG
+#define SESSION_AT(n) ((uint8_t *)(uintptr_t)(EE_SESSION_LOG + (n) * sizeof(struct SessionRecord)))
+
+/* Writes the record for this firmware load over the oldest one in the
+   ring.  The newest record is the one that the next one doesn't follow.
+   With a blank EEPROM that's the first one and the first record written
+   goes in the second. */
+static void
+session_end(struct SessionRecord *s, uint8_t result)
+{
+    uint8_t n, seq;
+
+    for(n=0; n<SESSION_RECORDS-1; n++) {
+        seq = eeprom_read_byte(SESSION_AT(n)); /* seq is first */
+        if(eeprom_read_byte(SESSION_AT(n+1)) != (uint8_t)(seq + 1)) break;
+    }
+    s->seq = eeprom_read_byte(SESSION_AT(n)) + 1;
+    s->result = result;
+    eeprom_update_block(s, SESSION_AT((n + 1) % SESSION_RECORDS), sizeof(*s));
+    eeprom_busy_wait();
+}
+#endif
+
+#ifdef BL_SELFTEST
+/* Reads whichever receive buffer has a frame.  Returns 1 if neither
+   does.  There's only ever one frame in flight during the self test so
+   the order doesn't matter. */
+static uint8_t
+selftest_read(struct CanFrame *frame)
+{
+    uint8_t flags = can_poll_int();
+
+    if(flags & (1<<CAN_RX0IF)) {
+        can_read(0, frame);
+    } else if(flags & (1<<CAN_RX1IF)) {
+        can_read(1, frame);
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/* Runs the loopback self test and leaves the results in bl_selftest.
+   See selftest.h */
+static void
+selftest(void)
+{
+    struct CanFrame frame, back;
+    uint16_t start, wait, n;
+    uint8_t i;
+
+    memset(&bl_selftest, 0, sizeof(bl_selftest));
+    can_mode(CAN_MODE_LOOPBACK, 1);
+    while(selftest_read(&back) == 0);
+    frame.id = FIX_NODE_SPECIFIC + node_id;
+    frame.length = 8;
+    start = TCNT1;
+    for(n=0; n<SELFTEST_FRAMES; n++) {
+        for(i=0; i<8; i++) frame.data[i] = n + i;
+        while(can_send(0, 3, frame));
+        bl_selftest.sent++;
+        wait = TCNT1;
+        while((i = selftest_read(&back)) && (uint16_t)(TCNT1 - wait) <= SELFTEST_WAIT);
+        if(i) continue; /* It never came back */
+        if(back.id == frame.id && back.length == frame.length &&
+           memcmp(back.data, frame.data, frame.length) == 0) {
+            bl_selftest.received++;
+        } else {
+            bl_selftest.errors++;
+        }
+    }
+    bl_selftest.burst_us = (uint32_t)(uint16_t)(TCNT1 - start) * SELFTEST_TICK_NS / 1000;
+    if(bl_selftest.burst_us) {
+        bl_selftest.frames_per_sec = bl_selftest.received * 1000000UL / bl_selftest.burst_us;
+    }
+    /* Timer 1 is too slow to time one SPI transaction so we time a lot */
+    start = TCNT1;
+    for(n=0; n<SELFTEST_SPI; n++) can_poll_int();
+    bl_selftest.spi_ns = (uint32_t)(uint16_t)(TCNT1 - start) * SELFTEST_TICK_NS / SELFTEST_SPI;
+    can_mode(CAN_MODE_NORMAL, 1);
+    bl_selftest.mode = can_mode(CAN_MODE_QUERY, 0);
 }
 #endif
 
+#if defined(BL_STATS) || defined(BL_STACK_PAINT) || defined(BL_SESSION_LOG) || defined(BL_SELFTEST)
+/* If frame is a FIX_BL_STATS, FIX_BL_STACK, FIX_BL_LOG or FIX_BL_SELFTEST query for us
+   we send back the part of the block that was asked for.  frame is
+   turned into the response. */
+static void
+stats_query(struct CanFrame *frame)
+{
+    const uint8_t *block;
+    uint8_t size, offset, n;
+
+    if(frame->id < FIX_NODE_SPECIFIC || frame->id >= (FIX_NODE_SPECIFIC+256) ||
+       frame->data[1] != node_id) return;
+    switch(frame->data[0]) {
+#ifdef BL_STATS
+    case FIX_BL_STATS:
+        block = (const uint8_t *)&bl_stats;
+        size = sizeof(bl_stats);
+        break;
+#endif
+#ifdef BL_STACK_PAINT
+    case FIX_BL_STACK:
+        stack_low();
+        block = (const uint8_t *)&bl_stack;
+        size = sizeof(bl_stack);
+        break;
+#endif
+#ifdef BL_SESSION_LOG
+    case FIX_BL_LOG:
+        block = NULL; /* It's in the EEPROM */
+        size = SESSION_RECORDS * sizeof(struct SessionRecord);
+        break;
+#endif
+#ifdef BL_SELFTEST
+    case FIX_BL_SELFTEST:
+        if(frame->data[2] == 0) selftest();
+        block = (const uint8_t *)&bl_selftest;
+        size = sizeof(bl_selftest);
+        break;
+#endif
+    default:
+        return;
+    }
+    offset = frame->data[2];
+    n = offset < size ? size - offset : 0;
+    if(n > CAN_MAX_DLEN - 3) n = CAN_MAX_DLEN - 3;
+#ifdef BL_SESSION_LOG
+    if(block == NULL) {
+        eeprom_busy_wait();
+        eeprom_read_block(&frame->data[3], SESSION_AT(0) + offset, n);
+    } else
+#endif
+    memcpy(&frame->data[3], block + offset, n);
+    frame->data[1] = frame->id - FIX_NODE_SPECIFIC; /* The node that asked */
+    frame->id = FIX_NODE_SPECIFIC + node_id;
+    frame->length = 3 + n;
+    while(can_send(0, 3, *frame)); /* Our last answer on the channel can still be going */
+}
+#else
+  #define stats_query(frame)
+#endif
+
+/* Reads receive buffer rxbuff into frame.  If fill isn't 0xFFFFFFFF
+   load_firmware() is waiting for buffer data for the flash and if the
+   frame is from id, our channel, the data goes straight into the page
+   buffer at fill instead.  Node specific queries still get in to
+   buffer 1 and they are read the normal way. */
+static void
+rx_read(uint8_t rxbuff, struct CanFrame *frame, uint32_t fill, uint16_t id)
+{
+#ifdef BL_READ_FILL
+    if(fill != 0xFFFFFFFF) {
+        can_read_fill(rxbuff, frame, fill, id);
+        return;
+    }
+#endif
+    STACK_COST(STK_CAN_READ, can_read(rxbuff, frame));
+}
+
+/* Reads the oldest frame out of the receive buffers.  Returns 0 if
+   there was one and 1 if both buffers are empty.  With rollover a frame
+   only goes to buffer 1 when buffer 0 is full, so buffer 1 is only the
+   older one if it was already full when we emptied buffer 0.  We look at
+   the flags again right after reading buffer 0 to find that out. */
+static uint8_t
+rx_oldest(struct CanFrame *frame, uint32_t fill, uint16_t id)
+{
+    static uint8_t rx1_older;
+    uint8_t flags;
+
+    flags = can_poll_int();
+    if((flags & (1<<CAN_RX1IF)) && (rx1_older || !(flags & (1<<CAN_RX0IF)))) {
+        rx_read(1, frame, fill, id);
+        rx1_older = 0;
+        return 0;
+    }
+    if(flags & (1<<CAN_RX0IF)) {
+        rx_read(0, frame, fill, id);
+        rx1_older = can_poll_int() & (1<<CAN_RX1IF);
+        return 0;
+    }
+    return 1;
+}
+
+#ifdef BL_PACING
+/* Set by the Pacing command (0x08).  The uploader can pick the transmit
+   priority of our responses and the shortest time between them so that
+   it can slow us down on a busy bus. */
+static uint8_t pace_priority = 3;
+static uint16_t pace_ticks;   /* Timer 1 ticks */
+static uint16_t pace_last;
+static uint8_t pace_report;   /* Put the bus condition in the data acks */
+static uint8_t pace_lost;     /* Responses that lost arbitration or had errors */
+#endif
+
+/* Sends frame back on the response channel.  The uploader uses the
+   responses for flow control so we wait for the buffer rather than
+   drop one. */
+static void
+respond(struct CanFrame *frame)
+{
+#ifdef BL_PACING
+    uint8_t status;
+#endif
+
+    frame->id++; /* Add one for the response channel */
+#ifdef BL_PACING
+    while((uint16_t)(TCNT1 - pace_last) < pace_ticks);
+    /* Wait for the last one to go so we can see if it had to fight for
+       the bus.  The flags are cleared when the next one is loaded. */
+    do {
+        status = can_tx_status(0);
+    } while(status & (1<<CAN_TXREQ));
+    if((status & ((1<<CAN_MLOA) | (1<<CAN_TXERR))) && pace_lost < 0xFF) pace_lost++;
+    STACK_COST(STK_CAN_SEND, while(can_send(0, pace_priority, *frame)));
+    pace_last = TCNT1;
+#else
+    STACK_COST(STK_CAN_SEND, while(can_send(0, 3, *frame)));
+#endif
+    TRACE(TR_ACK);
+}
+
 /* This function polls the MCP2515 for a CAN frame that represents
-   the given channel.  It checks Rx 1 first and then Rx 0.  Rx 1 first
-   because it would be the older frame since we are using rollover */
+   the given channel.  The buffers are read oldest first.  See rx_read()
+   for fill. */
 static inline uint8_t
-read_channel(uint8_t channel, struct CanFrame *frame)
+read_channel(uint8_t channel, struct CanFrame *frame, uint32_t fill)
 {
-    uint8_t result;
     uint16_t counter = 0;
 
     while(counter++ < 0x40FF) { /* roughly 1 second or so */
-        result = can_poll_int();
-
-        /* Read Frame from Buffer 1 */
-        if(result & (1<<CAN_RX1IF)) {
-            can_read(1, frame);
+        TRACE_SPM_CHECK();
+#ifdef BL_EEPROM
+        ee_service();
+#endif
+#ifdef BL_CRC_CHECK
+        crc_step();
+#endif
+        if(rx_oldest(frame, fill, FIX_2WAY_CHANNEL + channel *2) == 0) {
             /* Check that it's one of ours */
-            if(frame->id == FIX_2WAY_CHANNEL + channel *2)
+            if(frame->id == FIX_2WAY_CHANNEL + channel *2) {
+                TRACE(TR_RX);
                 return 0;
+            }
+            STAT_INC(rx_ignored);
+            stats_query(frame);
 		}
-		/* Read frame from buffer 0 */
-        if(result & (1<<CAN_RX0IF)) {
-            can_read(0, frame);
-            /* Check that it's one of ours */
-            if(frame->id == FIX_2WAY_CHANNEL + channel *2)
-                return 0;
-        }
     }
+    STAT_INC(timeouts);
+    TRACE(TR_TIMEOUT);
     return 2; /* Timeout */
 }
 
@@ -239,16 +773,49 @@ load_firmware(uint8_t channel)
 	uint16_t crc;
 	uint32_t temp;
 	uint8_t to_count=0;
-#ifdef UART_DEBUG
-    char sout[5];
+	uint32_t fill = 0xFFFFFFFF; /* Where rx_oldest() puts buffer data */
+#ifdef BL_MERGE
+	uint8_t merge = 0;
+#endif
+#ifdef BL_EEPROM
+	uint8_t eeprom = 0;  /* The buffer data is for the EEPROM */
+#endif
+#ifdef BL_SESSION_LOG
+	struct SessionRecord session;
+	uint32_t last_fill = 0xFFFFFFFF;
+	uint16_t tick = TCNT1;
 
-	uart_write("Load Firmware ", 14);
-	itoa(channel, sout, 10);
-    uart_write(sout, strlen(sout));
-	uart_write("\n", 1);
+	memset(&session, 0, sizeof(session));
+	session.start = tick;
+	session.end = tick;
+	session.crc = 0xFFFF;
 #endif
+
+	LOG_REC(LOG_INFO, "Load Firmware ", channel);
     while(1) {
-        result = read_channel(channel, &frame);
+#ifdef BL_SESSION_LOG
+        /* Timer 1 wraps every few seconds but we always get back here
+           well before that */
+        session.end += (uint16_t)(TCNT1 - tick);
+        tick = TCNT1;
+#endif
+#ifdef BL_READ_FILL
+        /* Flash data can skip the frame unless it has to be merged or
+           the flash is busy.  We'd hold on to a receive buffer while we
+           waited for an erase.  The last frame of a run that's shorter
+           than a whole frame could be padding past the end, so it comes
+           the normal way too. */
+        fill = 0xFFFFFFFF;
+        if(address != 0xFFFFFFFF && !boot_spm_busy() && length - offset >= CAN_MAX_DLEN
+#ifdef BL_MERGE
+           && !merge
+#endif
+#ifdef BL_EEPROM
+           && !eeprom
+#endif
+           ) fill = address + offset;
+#endif
+        result = read_channel(channel, &frame, fill);
         if(address == 0xFFFFFFFF) { /* We're waiting for a command */
             /* We ignore failures while we are waiting for commands
                on the channel. */
@@ -257,87 +824,266 @@ load_firmware(uint8_t channel)
                 address = *(uint32_t *)(&frame.data[1]);
                 if(frame.data[0] == 0x01) { /* Fill Buffer */
 				    length = frame.data[5] | frame.data[6]<<8;
-#ifdef UART_DEBUG
-                    uart_write("FB ", 3);
-                    itoa(address, sout, 10);
-                    uart_write(sout, strlen(sout));
-					uart_write(" ", 1);
-					itoa(length, sout, 10);
-					uart_write(sout, strlen(sout));
-					uart_write("\n", 1);
+#ifdef BL_SESSION_LOG
+				    if(address <= last_fill && last_fill != 0xFFFFFFFF) session.resent++;
+				    last_fill = address;
 #endif
+#ifdef BL_EEPROM
+				    /* Writing the EEPROM while the page buffer is being
+				       loaded loses what's in it */
+				    ee_drain();
+				    eeprom = 0;
+#endif
+				    /* Empty the page buffer in case a page that timed out
+				       is being sent again */
+				    SPM_ATOMIC(boot_rww_enable_safe());
+#ifdef BL_CRC_CHECK
+				    /* The pages before this one are done.  crc_step() adds
+				       them to the CRC from here on. */
+				    crc_touch(address & ~(PGM_PAGE_SIZE-1UL));
+				    crc_want = address & ~(PGM_PAGE_SIZE-1UL);
+#endif
+#ifdef BL_MERGE
+				    /* Anything less than a whole page is merged with what
+				       is already in the flash and written by Merge Write */
+				    merge = (address & (PGM_PAGE_SIZE-1)) || length < PGM_PAGE_SIZE;
+				    if(merge) merge_load(address & ~(PGM_PAGE_SIZE-1UL));
+				    else merge_address = 0xFFFFFFFF; /* That page is changing */
+#endif
+                    LOG_HEX(LOG_INFO, "FB ", address);
+                    LOG_REC(LOG_INFO, " ", length);
                 } else if(frame.data[0] == 0x02) { /* Page Erase */
-				    boot_page_erase_safe(address);
-#ifdef UART_DEBUG
-                    uart_write("EP ", 3);
-					itoa(address, sout, 10);
-                    uart_write(sout, strlen(sout));
-					uart_write("\n", 1);
+#ifdef BL_CRC_CHECK
+				    crc_touch(address);
 #endif
+				    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_erase_safe(address)));
+				    STAT_INC(erases);
+				    TRACE_SPM(TR_ERASE_START);
+                    LOG_REC(LOG_INFO, "EP ", address);
 					address = 0xFFFFFFFF; /* So we don't try to read data */
                 } else if(frame.data[0] == 0x03) { /* Page Write */
-				    boot_page_write_safe(address);
-#ifdef UART_DEBUG
-                    uart_write("WP ", 3);
-					itoa(address, sout, 10);
-                    uart_write(sout, strlen(sout));
-					uart_write("\n", 1);
+#ifdef BL_CRC_CHECK
+				    crc_touch(address);
+#endif
+				    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_write_safe(address)));
+				    STAT_INC(writes);
+				    TRACE_SPM(TR_WRITE_START);
+#ifdef BL_SESSION_LOG
+				    session.pages++;
 #endif
+                    LOG_REC(LOG_INFO, "WP ", address);
 					address = 0xFFFFFFFF; /* So we don't try to read data */
                 } else if(frame.data[0] == 0x04) { /* Abort */
+                    LOG_STR(LOG_INFO, "A\n");
+					address = 0xFFFFFFFF; /* So we don't try to read data */
+#ifdef BL_MERGE
+                } else if(frame.data[0] == 0x07) { /* Merge Write */
+#ifdef BL_CRC_CHECK
+				    crc_touch(address & ~(PGM_PAGE_SIZE-1UL));
+#endif
+#ifdef BL_EEPROM
+				    ee_drain(); /* merge_write() loads the page buffer */
+#endif
+				    if(merge) {
+					    merge_write(address & ~(PGM_PAGE_SIZE-1UL));
+				    } else {
+					    /* The last Fill was a whole page so it's in the page
+					       buffer and merge_load() would empty that.  Write it
+					       the way Page Erase and Page Write would. */
+					    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_erase_safe(address & ~(PGM_PAGE_SIZE-1UL))));
+					    STAT_INC(erases);
+					    TRACE_SPM(TR_ERASE_START);
+					    STAT_TIME(spm_wait, SPM_ATOMIC(boot_page_write_safe(address & ~(PGM_PAGE_SIZE-1UL))));
+					    STAT_INC(writes);
+					    TRACE_SPM(TR_WRITE_START);
+				    }
+#ifdef BL_SESSION_LOG
+				    session.pages++;
+#endif
+                    LOG_REC(LOG_INFO, "MW ", address);
+					address = 0xFFFFFFFF; /* So we don't try to read data */
+#endif
+#ifdef BL_EEPROM
+                } else if(frame.data[0] == 0x09) { /* EEPROM Write */
+				    length = frame.data[5] | frame.data[6]<<8;
+				    ee_drain(); /* The queue only holds one run of bytes */
+				    ee_address = address;
+				    eeprom = 1;
+                    LOG_REC(LOG_INFO, "EW ", address);
+                } else if(frame.data[0] == 0x0A) { /* EEPROM Read */
+				    /* Answers with the address and up to frame.data[5] bytes */
+				    ee_drain();
+				    length = frame.data[5];
+				    if(length > CAN_MAX_DLEN - 3) length = CAN_MAX_DLEN - 3;
+				    for(n=0; n<length; n++) {
+					    frame.data[3+n] = eeprom_read_byte((uint8_t *)(uintptr_t)(address + n));
+				    }
+				    frame.length = 3 + length;
+					address = 0xFFFFFFFF; /* So we don't try to read data */
+                } else if(frame.data[0] == 0x0B) { /* Reset */
+				    ee_drain();
+				    respond(&frame);
+#ifdef BL_SESSION_LOG
+				    session_end(&session, SESSION_RESET);
+#endif
+                    LOG_STR(LOG_INFO, "R\n");
 #ifdef UART_DEBUG
-                    uart_write("A\n", 2);
+					log_stop();
 #endif
+				    reset();
+#endif
+#ifdef BL_PACING
+                } else if(frame.data[0] == 0x08) { /* Pacing */
+				    pace_priority = frame.data[1] & 0x03;
+				    pace_ticks = (uint32_t)frame.data[2] * (BOOT_F_CPU / 1024) / 1000;
+				    pace_report = frame.data[3];
+                    LOG_REC(LOG_INFO, "P ", frame.data[2]);
+					address = 0xFFFFFFFF; /* So we don't try to read data */
+#endif
+#ifdef BL_TRACE
+                } else if(frame.data[0] == 0x06) { /* Trace Dump */
+				    trace_send(frame);
 					address = 0xFFFFFFFF; /* So we don't try to read data */
+					continue; /* trace_send() did the response */
+#endif
                 } else if(frame.data[0] == 0x05) { /* Complete */
 				    crc = *(uint16_t *)(&frame.data[1]);
                     temp = *(uint32_t *)(&frame.data[3]); /* Size */
-                    frame.id++; /* Add one for the response channel */
-					can_send(0, 3, frame); /* Send Response */
+#ifdef BL_EEPROM
+				    ee_drain();
+#endif
+				    if(temp > PGM_LAST_PAGE_START + PGM_PAGE_SIZE) {
+					    /* That's past the end of the application.  Answer
+					       with a CRC that can't match so nothing is stored. */
+					    frame.data[1] = ~crc;
+					    frame.data[2] = ~crc >> 8;
+					    LOG_REC(LOG_ERROR, "SZ ", temp);
+					    respond(&frame);
+					    address = 0xFFFFFFFF;
+					    continue;
+				    }
+#ifdef BL_CRC_CHECK
+				    SPM_ATOMIC(boot_rww_enable_safe());
+				    crc_fold(temp);
+				    if(crc_run != crc) {
+					    /* Answer with the CRC that we have and wait for the
+					       uploader to send it again.  Nothing is stored so if
+					       it gives up the old CRC shouldn't match either. */
+					    frame.data[1] = crc_run;
+					    frame.data[2] = crc_run >> 8;
+					    LOG_HEX(LOG_ERROR, "CRC ", crc_run);
+					    respond(&frame);
+					    address = 0xFFFFFFFF;
+					    continue;
+				    }
+#endif
+					respond(&frame);
 					store_crc(crc, temp);
+#ifdef BL_SESSION_LOG
+					session.crc = crc;
+					session_end(&session, SESSION_COMPLETE);
+#endif
 					
+					LOG_STR(LOG_INFO, "C\n");
+#if defined(UART_DEBUG) && defined(BL_TRACE)
+					trace_print();
+#endif
 #ifdef UART_DEBUG
-					uart_write("C\n", 2);
+					log_stop();
 #endif
                     reset();
                 }
-                frame.id++; /* Add one for the response channel */
-                can_send(0, 3, frame); /* Send Response */
+                respond(&frame);
             } else if(result == 2) { /* Timeout */
 			    to_count++;
-				if(to_count > 30) return;
+#ifdef BL_SESSION_LOG
+				session.timeouts++;
+#endif
+				if(to_count > 30) {
+#ifdef BL_EEPROM
+				    ee_drain();
+#endif
+#ifdef BL_SESSION_LOG
+				    session_end(&session, SESSION_GAVE_UP);
+#endif
+#if defined(UART_DEBUG) && defined(BL_TRACE)
+				    trace_print();
+#endif
+				    return;
+				}
 			}
         } else { /* We're waiting for buffer data. */
             if(result == 0) {
+			    /* A CAN FD frame gets padded out to the next length that
+			       it can have.  That isn't part of the run and mustn't
+			       go in the flash or the EEPROM. */
+			    if(frame.length > length - offset) frame.length = length - offset;
+#ifdef BL_EEPROM
+			    if(eeprom) {
+				    /* Wait for room.  ee_service() only gets called
+				       between frames otherwise. */
+				    while(EE_QUEUE - ee_count < frame.length) ee_service();
+				    for(n=0; n<frame.length; n++) {
+					    ee_queue[ee_head] = frame.data[n];
+					    ee_head = (ee_head + 1) & (EE_QUEUE-1);
+				    }
+				    ee_count += frame.length;
+				} else
+#endif
+#ifdef BL_READ_FILL
+			    if(fill != 0xFFFFFFFF) {
+				    /* rx_oldest() already put it in the page buffer */
+				} else
+#endif
+#ifdef BL_MERGE
+			    if(merge) {
+				    for(n=0; n<frame.length; n++) {
+					    temp = (address & (PGM_PAGE_SIZE-1)) + offset + n;
+					    if(temp < PGM_PAGE_SIZE) merge_page[temp] = frame.data[n];
+					}
+				} else
+#endif
 			    for(n=0; n<frame.length; n+=2) {
 				    temp = *(uint16_t *)(&frame.data[n]);
-					boot_page_fill_safe(address+offset+n, temp);
+					SPM_ATOMIC(boot_page_fill_safe(address+offset+n, temp));
 				}
 				offset+=frame.length;
-#ifdef UART_DEBUG
-				uart_write(".", 1);
-#endif
+				LOG_STR(LOG_DEBUG, ".");
                 /* The following is an ack for buffer load data
 				   I don't know that we really need it. */
-				frame.id++;
 				frame.data[0] = offset;
 				frame.data[1] = (offset & 0xFF00) >>8;
 				frame.length = 2;
-				can_send(0, 3, frame);
+#ifdef BL_PACING
+				if(pace_report) {
+				    /* Error counters and how many of our responses had
+				       trouble getting out since the last one */
+				    can_errors(&frame.data[2]);
+				    frame.data[4] = pace_lost;
+				    pace_lost = 0;
+				    frame.length = 5;
+				}
+#endif
+				respond(&frame);
 				if(offset >= length) {
 				    address = 0xFFFFFFFF; /* To get out of here */
 					offset = 0;
-#ifdef UART_DEBUG
-					uart_write("#\n", 2);
+#ifdef BL_EEPROM
+					eeprom = 0;
 #endif
+					LOG_STR(LOG_DEBUG, "#\n");
                 }
 
 			} else if(result == 2) { /* This is a timeout */
+#ifdef BL_SESSION_LOG
+				session.timeouts++;
+#endif
                 address = 0xFFFFFFFF;
 				offset = 0;
-#ifdef UART_DEBUG
-				uart_write("t\n", 2); /* TODO: Should send an abort */
+#ifdef BL_EEPROM
+				eeprom = 0;
 #endif
+				LOG_STR(LOG_ERROR, "t\n"); /* TODO: Should send an abort */
 			}
         }
     }
@@ -347,54 +1093,57 @@ load_firmware(uint8_t channel)
 void
 print_frame(struct CanFrame frame)
 {
-#ifdef UART_DEBUG
-    char sout[5];
+#if defined(UART_DEBUG) && LOG_LEVEL >= LOG_DEBUG
     int n;
 	
-	uart_write("CAN", 3);
-    itoa(frame.id, sout, 16);
-    uart_write(sout, strlen(sout));
-    uart_write("D", 1);
-
+	log_hex("CAN", frame.id);
+    log_str("D");
     for(n=0; n<frame.length; n++) {
-        itoa(frame.data[n], sout, 16);
-        if(frame.data[n] <= 0x0F) {
-            sout[1] = sout[0];
-            sout[0] = '0';
-        }
-        uart_write(sout, 2);
+        log_byte(frame.data[n]);
     }
-    uart_write("\n", 1);
+    log_str("\n");
 #endif
 }
 
-/* This function checks each Rx buffer in the MCP2515 starting with
-   buffer 1 since that will have the older frame in it.  If that has
-   a node specific message in it then we return 1.  Else try Rx buffer
-   0 and do the same.  If there are no node specific messages in either
-   buffer then return 0 */
+/* This function reads the oldest frame out of the MCP2515.  If it is
+   a node specific message then we return 1.  If there are no frames or
+   it's something else we return 0 */
 uint8_t
 get_ns_frame(struct CanFrame *frame) {
-	uint8_t result;
-	
-    result = can_poll_int();
-
- /* We're going to look in both buffers starting with 1 since that would
-    be where the oldest of the two would be. */
-    if(result & (1<<CAN_RX1IF)) {
-        can_read(1, frame);
-		if(frame->id >= FIX_NODE_SPECIFIC && frame->id < (FIX_NODE_SPECIFIC+256)) {
-			return 1;
-		}
-	} else if(result & (1<<CAN_RX0IF)) {
-		can_read(0, frame);
+    if(rx_oldest(frame, 0xFFFFFFFF, 0) == 0) {
 		if(frame->id >= FIX_NODE_SPECIFIC && frame->id < (FIX_NODE_SPECIFIC+256)) {
 			return 1;
 		}
+		STAT_INC(rx_ignored);
 	}
 	return 0;
 }
 
+/* Sets receive buffer 0's mask to mask and both of its filters to id.
+   While we load firmware other nodes can be loading on the other
+   channels, and without this their frames would fill our receive buffers
+   while we wait on SPM and crowd out our own.  Buffer 1 lets in 0x6C0 to
+   0x7BF so that stats_query() still gets the node specific queries from
+   nodes 0x00 to 0xDF.  That leaves the channels out.  Our own frames
+   still roll over into buffer 1 when buffer 0 is full, but not if a
+   query is sitting there, so a query during a load can cost the
+   uploader a page.  With a mask of 0 everything gets in to both. */
+static void
+rx_filter(uint16_t mask, uint16_t id)
+{
+    uint8_t n;
+    static const uint8_t filters[6] = {CAN_RXF0SIDH, CAN_RXF1SIDH, CAN_RXF2SIDH,
+                                       CAN_RXF3SIDH, CAN_RXF4SIDH, CAN_RXF5SIDH};
+
+    STACK_COST(STK_CAN_MODE, can_mode(CAN_MODE_CONFIG, 1));
+    STACK_COST(STK_CAN_MASK, can_mask(0, mask));
+    can_mask(1, mask ? 0x7C0 : 0x000);
+    for(n=0; n<6; n++) {
+        STACK_COST(STK_CAN_FILTER, can_filter(filters[n], n < 2 || !mask ? id : 0x6C0 + (n-2) * 0x40));
+    }
+    can_mode(CAN_MODE_NORMAL, 1);
+}
+
 /* This is the function that we call periodically during the one
    second startup time to see if we have a bootloader request on
    the CAN Bus. */
@@ -417,10 +1166,14 @@ bload_check(void) {
             frame.data[0] = FIX_FIRMWARE;
             frame.data[1] = send_node;
             frame.data[2] = 0x00;
+            /* Only listen to our channel from here on */
+            rx_filter(0x7FF, FIX_2WAY_CHANNEL + channel*2);
             can_send(0, 3, frame);
 			/* Jump to load firmware */
             load_firmware(channel); /* We should never come back from here */
+            rx_filter(0x000, 0x000); /* but if we do it timed out */
         } 
+        stats_query(&frame);
     }
     return 0;
 }
@@ -434,6 +1187,7 @@ pgmcrc(uint16_t count) {
     uint16_t crc = 0xffff;
 	uint16_t addr = 0; 
 
+    TRACE(TR_CRC_START);
     while(addr != count) {
         int i = 8;
 
@@ -447,6 +1201,7 @@ pgmcrc(uint16_t count) {
             if (carry) crc ^= 0xA001;
         }
     }
+    TRACE(TR_CRC_END);
     return crc;
 }
 #elif PGM_LENGTH_BITS == 32
@@ -471,6 +1226,7 @@ pgmcrc(uint32_t count) {
 		}
 	}
 		
+	TRACE(TR_CRC_START);
 	while(addr != count) {
 		if(addr % 64 == 0)
 		    bload_check();
@@ -480,6 +1236,7 @@ pgmcrc(uint32_t count) {
 		crc ^= crctable[temp];
 
 	}
+	TRACE(TR_CRC_END);
 	return crc;
 }
 #endif
@@ -489,33 +1246,41 @@ int
 main(void)
 {
 	struct CanFrame frame;
-    uint16_t pgm_crc, cmp_crc, timer=0;
-	uint8_t crcgood=0;
+    uint16_t pgm_crc, cmp_crc, length, last, ticks;
+	uint8_t crcgood=0, seconds, period;
 	
 #if PGM_LENGTH_BITS == 16
     uint16_t count;
 #elif PGM_LENGTH_BITS == 32
     uint32_t count;
 #endif
-#ifdef UART_DEBUG
-    char sout[8];    
-#endif
 
 	init();
-#ifdef UART_DEBUG
-	uart_write("\nStart Node ", 12);
-	itoa(node_id,sout, 16);
-	uart_write(sout, strlen(sout));
-	uart_write("\n", 1);
+	LOG_REC(LOG_INFO, "\nStart Node ", node_id);
+#ifdef BL_STACK_PAINT
+	stack_probe();
+#endif
+#ifdef BL_SELFTEST
+	if(eeprom_read_byte(EE_SELFTEST) == 0x01) {
+	    /* Answer a query from node 0 that never came */
+	    frame.id = FIX_NODE_SPECIFIC;
+	    frame.data[0] = FIX_BL_SELFTEST;
+	    frame.data[1] = node_id;
+	    frame.data[2] = 0;
+	    stats_query(&frame);
+	    TCNT1 = 0x0000; /* Don't count the test against the startup time */
+	}
 #endif
 
 #if PGM_LENGTH_BITS == 16
     /* Find the firmware size and checksum */
 	count   = pgm_read_word_near(PGM_LENGTH);
     cmp_crc = pgm_read_word_near(PGM_CRC);
+	length  = count;
 #elif PGM_LENGTH_BITS == 32
 	count   = pgm_read_dword_far(PGM_LENGTH);
 	cmp_crc = pgm_read_word_far(PGM_CRC);
+	length  = count > 0xFFFF ? 0xFFFF : count; /* 0xFFFF for 64K or more */
 #endif
     if(count >= PGM_LAST_PAGE_START + PGM_PAGE_SIZE) count = PGM_LAST_PAGE_START + PGM_PAGE_SIZE; /* bounds check */
 	/* Retrieve the Program Checksum */
@@ -524,44 +1289,58 @@ main(void)
 	if(pgm_crc == cmp_crc) {
 	    crcgood = 1;
     }
-#ifdef UART_DEBUG
-    itoa(pgm_crc,sout,16);
-	uart_write("Checksum ", 9);
-	uart_write(sout,strlen(sout));
-	itoa(cmp_crc,sout,16);
-	uart_write(" ?= ", 4);
-	uart_write(sout,strlen(sout));
-	uart_write("\n",1);
-#endif
+	LOG_HEX(LOG_INFO, "Checksum ", pgm_crc);
+	LOG_REC(LOG_INFO, " ?= ", cmp_crc);
 	/* This timer expires at roughly one second after startup */
-	while(TCNT1 <= 0x2B00) /* Run this for about a second */
+	while(TCNT1 <= BOOT_WAIT) /* Run this for about a second */
         bload_check();
     TCNT1 = 0x0000;
+	LOG_STR(LOG_INFO, "TIMEOUT\n");
+	if(crcgood) {
 #ifdef UART_DEBUG
-	uart_write("TIMEOUT\n",8);
+	   log_stop();
+#endif
+#ifdef CLOCK_BOOST
+	   clock_prescale_set((clock_div_t)CLOCK_BOOST_PS); /* The clock the application expects */
 #endif
-	if(crcgood) {
 	   start_app(); /* When we go here we ain't never comin' back */
     }
 	
     /* If CRC is no good we sit here and look for a firmware update command
-       forever. */
-#ifdef UART_DEBUG
-	uart_write("Program Fail\n",13);
-#endif
+       forever.  The alarm goes out right away and then twice as far
+       apart each time up to HEARTBEAT_MAX so that it doesn't get in the
+       way of the update that fixes us. */
+	LOG_STR(LOG_ERROR, "Program Fail\n");
     PORTB |= (1<<PB0);
+	period = 0;
+	seconds = 0;
+	ticks = 0;
+	last = TCNT1;
     while(1) { 
-		if(timer == 0) {
+        /* Timer 1 wraps every few seconds so we count them ourselves */
+        ticks += (uint16_t)(TCNT1 - last);
+        last = TCNT1;
+        if(ticks >= HEARTBEAT_SECOND) {
+            ticks -= HEARTBEAT_SECOND;
+            seconds++;
+        }
+		if(seconds >= period) {
 			/* Send a node alarm message indicating a firmware failure */
 			frame.id = node_id;
-			frame.length = 4;
+			frame.length = 8;
 			frame.data[0] = 0x00; /* Alarm type LSB */
 			frame.data[1] = 0x00; /* Alarm type MSB */
 			frame.data[2] = (uint8_t)(pgm_crc & 0x00FF); /* Send current checksum */
 			frame.data[3] = (uint8_t)(pgm_crc >> 8);
+			frame.data[4] = (uint8_t)(cmp_crc & 0x00FF); /* The one that was stored */
+			frame.data[5] = (uint8_t)(cmp_crc >> 8);
+			frame.data[6] = (uint8_t)(length & 0x00FF); /* The stored image length */
+			frame.data[7] = (uint8_t)(length >> 8);
 			can_send(0, 3, frame);
+			seconds = 0;
+			period = period ? period * 2 : HEARTBEAT_PERIOD;
+			if(period > HEARTBEAT_MAX) period = HEARTBEAT_MAX;
 		}
-		timer++;
         bload_check();
 	}	
 }
@@ -89,6 +89,8 @@
 	#define CAN_RX0IF 0
 #define CAN_EFLG 0x2D
 #define CAN_TXB0CTRL 0x30
+	#define CAN_MLOA 5
+	#define CAN_TXERR 4
 	#define CAN_TXREQ 3
 #define CAN_TXB0SIDH 0x31
 #define CAN_TXB0SIDL 0x32
@@ -142,4 +144,57 @@
 #define CAN_MODE_LOOPBACK  0x40
 #define CAN_MODE_QUERY     0xF0
 
+/* Bit Timing Calculator
+
+   These macros work out the CNF1, CNF2 and CNF3 register values for a
+   bit rate (in bits/sec) from the MCP2515 oscillator frequency at compile
+   time.  The bit time is made up of 8 to 25 time quanta (TQ) and the
+   oscillator has to divide evenly into 2 * BRP * TQ * rate, with BRP
+   being 1 to 64.  The sample point depends only on the number of TQ so
+   CAN_NTQ() tries them in order of how close they can get to the
+   87.5% sample point that CiA recommends.  CAN_NTQ() is 0 if the rate
+   can't be made from this oscillator and then all three CAN_TIMING_CNFx()
+   values are 0.  A good CNF2 always has BTLMODE set so that can be
+   checked at run time.
+
+   Phase segment 2 is at least 2 TQ and SJW is always 1 TQ. */
+#ifndef MCP2515_OSC
+  #define MCP2515_OSC 20000000UL
+#endif
+
+#define CAN_TQ_FITS(rate, n) (MCP2515_OSC % (2UL * (rate) * (n)) == 0 && \
+                              MCP2515_OSC / (2UL * (rate) * (n)) >= 1 && \
+                              MCP2515_OSC / (2UL * (rate) * (n)) <= 64)
+#define CAN_NTQ(rate) ( \
+    CAN_TQ_FITS(rate, 16) ? 16 : \
+    CAN_TQ_FITS(rate, 17) ? 17 : \
+    CAN_TQ_FITS(rate, 15) ? 15 : \
+    CAN_TQ_FITS(rate, 18) ? 18 : \
+    CAN_TQ_FITS(rate, 14) ? 14 : \
+    CAN_TQ_FITS(rate, 19) ? 19 : \
+    CAN_TQ_FITS(rate, 20) ? 20 : \
+    CAN_TQ_FITS(rate, 13) ? 13 : \
+    CAN_TQ_FITS(rate, 12) ? 12 : \
+    CAN_TQ_FITS(rate, 11) ? 11 : \
+    CAN_TQ_FITS(rate, 21) ? 21 : \
+    CAN_TQ_FITS(rate, 10) ? 10 : \
+    CAN_TQ_FITS(rate, 9) ? 9 : \
+    CAN_TQ_FITS(rate, 22) ? 22 : \
+    CAN_TQ_FITS(rate, 8) ? 8 : \
+    CAN_TQ_FITS(rate, 23) ? 23 : \
+    CAN_TQ_FITS(rate, 24) ? 24 : \
+    CAN_TQ_FITS(rate, 25) ? 25 : \
+    0)
+#define CAN_BRP(rate)  (MCP2515_OSC / (2UL * (rate) * (CAN_NTQ(rate) ? CAN_NTQ(rate) : 1)))
+#define CAN_PS2_(n)    ((n) - ((n) * 7 + 4) / 8 < 2 ? 2 : (n) - ((n) * 7 + 4) / 8)
+#define CAN_PS2(n)     ((n) - 17 > CAN_PS2_(n) ? (n) - 17 : CAN_PS2_(n))
+#define CAN_TSEG(n)    ((n) - 1 - CAN_PS2(n)) /* Propagation + Phase 1 */
+#define CAN_PROP(n)    (CAN_TSEG(n) / 2)
+#define CAN_PS1(n)     (CAN_TSEG(n) - CAN_PROP(n))
+
+#define CAN_TIMING_CNF1(rate) (CAN_NTQ(rate) ? (uint8_t)(CAN_BRP(rate) - 1) : 0)
+#define CAN_TIMING_CNF2(rate) (CAN_NTQ(rate) ? (uint8_t)(0x80 | (CAN_PS1(CAN_NTQ(rate)) - 1) << 3 | \
+                                                          (CAN_PROP(CAN_NTQ(rate)) - 1)) : 0)
+#define CAN_TIMING_CNF3(rate) (CAN_NTQ(rate) ? (uint8_t)(CAN_PS2(CAN_NTQ(rate)) - 1) : 0)
+
 #endif
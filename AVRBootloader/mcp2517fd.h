@@ -0,0 +1,168 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * This header contains definitions and macros for using
+ * the MCP2517FD and MCP2518FD CAN FD controller ICs. */
+
+#ifndef MCP2517FD_H
+#define MCP2517FD_H 1
+
+//Port Pin
+#define CAN_INT_PORT PORTD
+#define CAN_INT_DDR  DDRD
+#define CAN_INT_PIN  PD2
+
+//Command Nibbles.  The other 12 bits of the first two bytes are the address
+#define FD_RESET 0x00
+#define FD_WRITE 0x20
+#define FD_READ  0x30
+
+//Registers.  These are all 32 bits, least significant byte first
+#define FD_C1CON     0x000
+	#define FD_REQOP_BYTE   3 /* REQOP is bits 26:24 */
+	#define FD_OPMOD_BYTE   2 /* OPMOD is bits 23:21 */
+	#define FD_TXQEN   4 /* Bit in byte 2 */
+	#define FD_STEF    3 /* Bit in byte 2 */
+#define FD_C1NBTCFG  0x004
+#define FD_C1DBTCFG  0x008
+#define FD_C1TDC     0x00C
+	#define FD_TDCMOD_AUTO 0x02 /* Byte 2 */
+#define FD_C1INT     0x01C
+	#define FD_TXIF    0 /* Byte 0 */
+	#define FD_RXIF    1
+	#define FD_CERRIF  5 /* Byte 1 */
+	#define FD_IVMIF   7
+	#define FD_TXIE    0 /* Byte 2 */
+	#define FD_RXIE    1
+	#define FD_CERRIE  5 /* Byte 3 */
+	#define FD_IVMIE   7
+#define FD_C1TREC    0x034
+#define FD_C1FIFOCON(m) (0x050 + 12 * (m))
+	#define FD_TFNRFNIE 0 /* Byte 0 */
+	#define FD_TXEN     7
+	#define FD_UINC     0 /* Byte 1 */
+	#define FD_TXREQ    1
+	#define FD_FRESET   2
+	#define FD_TXAT_UNLIMITED 0x60 /* Byte 2, TXPRI is the low 5 bits */
+	#define FD_PLSIZE_64 0xE0 /* Byte 3, FSIZE is the low 5 bits */
+#define FD_C1FIFOSTA(m) (0x054 + 12 * (m))
+	#define FD_TFNRFNIF 0 /* Byte 0 */
+	#define FD_TXERR    5
+	#define FD_TXLARB   6
+#define FD_C1FIFOUA(m)  (0x058 + 12 * (m))
+#define FD_C1FLTCON(n)  (0x1D0 + (n))  /* One byte per filter */
+	#define FD_FLTEN   7
+#define FD_C1FLTOBJ(n)  (0x1F0 + 8 * (n))
+#define FD_C1MASK(n)    (0x1F4 + 8 * (n))
+	#define FD_MIDE    6 /* Bit in byte 3 */
+#define FD_RAM       0x400
+#define FD_OSC       0xE00
+	#define FD_OSCRDY  2 /* Bit in byte 1 */
+
+//Message Objects.  The second word of both TX and RX objects
+#define FD_OBJ_IDE 4
+#define FD_OBJ_BRS 6
+#define FD_OBJ_FDF 7
+
+/* How the FIFOs are used.  One TX FIFO for each of the three transmit
+   buffers that can_send() knows about and a single deep RX FIFO that
+   shows up as receive buffer 0.  Having a queue instead of two buffers
+   means that the frames always come out in the order they arrived. */
+#define FD_TX_FIFO(txbuff) (1 + (txbuff))
+#define FD_RX_FIFO 4
+#define FD_RX_DEPTH 8
+
+/* These mirror the MCP2515 names so that the code above the driver can
+   be the same for both chips.  can_poll_int() returns the MCP2515
+   CANINTF layout, can_tx_status() the TXBxCTRL layout and the filter
+   'registers' are just filter numbers. */
+#define CAN_MERRF 7
+#define CAN_ERRIF 5
+#define CAN_TX2IF 4
+#define CAN_TX1IF 3
+#define CAN_TX0IF 2
+#define CAN_RX1IF 1
+#define CAN_RX0IF 0
+
+#define CAN_MLOA  5
+#define CAN_TXERR 4
+#define CAN_TXREQ 3
+
+#define CAN_RXF0SIDH 0
+#define CAN_RXF1SIDH 1
+#define CAN_RXF2SIDH 2
+#define CAN_RXF3SIDH 3
+#define CAN_RXF4SIDH 4
+#define CAN_RXF5SIDH 5
+
+//Modes of Operation
+#define CAN_MODE_MASK      0x07
+#define CAN_MODE_NORMAL    0x00 /* Mixed CAN FD and CAN 2.0 */
+#define CAN_MODE_SLEEP     0x01
+#define CAN_MODE_LOOPBACK  0x02 /* Internal loopback */
+#define CAN_MODE_LISTEN    0x03
+#define CAN_MODE_CONFIG    0x04
+#define CAN_MODE_CLASSIC   0x06 /* CAN 2.0 only */
+#define CAN_MODE_QUERY     0xF0
+
+/* Bit Timing Calculator
+
+   The MCP2517FD has a lot more room in its bit timing registers than the
+   MCP2515 so the calculation is simpler.  We use the smallest prescaler
+   that fits, put the sample point at 80% and make SJW as big as phase
+   segment 2.  The CAN_TIMING_CNFx() values are the prescaler, TSEG1 and
+   TSEG2 bytes of C1NBTCFG and are what can_init() takes.  A rate that
+   can't be made from the clock comes out as all zeros.
+
+   The data phase of FD frames uses bit rate switching at CAN_FD_DATA_RATE
+   with automatic transmitter delay compensation. */
+#ifndef MCP2517FD_OSC
+  #define MCP2517FD_OSC 40000000UL
+#endif
+#ifndef CAN_FD_DATA_RATE
+  #define CAN_FD_DATA_RATE 2000000UL
+#endif
+
+#define FD_NTQ_FITS(rate, brp, max) (MCP2517FD_OSC % ((rate) * (brp)) == 0 && \
+                                     MCP2517FD_OSC / ((rate) * (brp)) >= 4 && \
+                                     MCP2517FD_OSC / ((rate) * (brp)) <= (max))
+#define FD_BRP(rate, max) ( \
+    FD_NTQ_FITS(rate, 1UL, max) ? 1UL : \
+    FD_NTQ_FITS(rate, 2UL, max) ? 2UL : \
+    FD_NTQ_FITS(rate, 4UL, max) ? 4UL : \
+    FD_NTQ_FITS(rate, 5UL, max) ? 5UL : \
+    FD_NTQ_FITS(rate, 8UL, max) ? 8UL : \
+    FD_NTQ_FITS(rate, 10UL, max) ? 10UL : \
+    FD_NTQ_FITS(rate, 16UL, max) ? 16UL : \
+    FD_NTQ_FITS(rate, 20UL, max) ? 20UL : \
+    0)
+#define FD_NTQ(rate, max)   (MCP2517FD_OSC / ((rate) * (FD_BRP(rate, max) ? FD_BRP(rate, max) : 1)))
+#define FD_TSEG2(rate, max) (FD_NTQ(rate, max) - (FD_NTQ(rate, max) * 4 + 2) / 5)
+#define FD_TSEG1(rate, max) (FD_NTQ(rate, max) - 1 - FD_TSEG2(rate, max))
+
+/* Nominal (arbitration) phase.  TSEG1 can be up to 256 TQ which puts the
+   limit at 320 TQ for an 80% sample point. */
+#define CAN_TIMING_CNF1(rate) (FD_BRP(rate, 320) ? (uint8_t)(FD_BRP(rate, 320) - 1) : 0)
+#define CAN_TIMING_CNF2(rate) (FD_BRP(rate, 320) ? (uint8_t)(FD_TSEG1(rate, 320) - 1) : 0)
+#define CAN_TIMING_CNF3(rate) (FD_BRP(rate, 320) ? (uint8_t)(FD_TSEG2(rate, 320) - 1) : 0)
+
+/* Data phase.  DTSEG1 can be up to 32 TQ so the limit is 40 TQ. */
+#define FD_DBRP  (FD_BRP(CAN_FD_DATA_RATE, 40))
+#define FD_DTSEG1 (FD_TSEG1(CAN_FD_DATA_RATE, 40))
+#define FD_DTSEG2 (FD_TSEG2(CAN_FD_DATA_RATE, 40))
+
+#endif
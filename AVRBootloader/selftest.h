@@ -0,0 +1,65 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Loopback self test.  The CAN controller is put in loopback mode and
+ *  a burst of frames goes through can_send() and comes back through
+ *  can_read() without ever touching the bus, so it measures the SPI and
+ *  the driver on this board whatever the bus is doing.  The controller
+ *  still clocks each frame out at the bit rate we're set to so that
+ *  limits frames_per_sec too.  Timer 1 (clk/1024) does the timing.
+ *
+ *  The results are read with the FIX_BL_SELFTEST node specific query
+ *  the same way as the FIX_BL_STATS counters (see fix.h).  Asking for
+ *  offset 0 runs the test first, so read the rest of the block after
+ *  that.  Anything that was waiting in the receive buffers when we
+ *  switched to loopback is thrown away.
+ *
+ *  If the byte at EE_SELFTEST (byte 3 of the EEPROM, see bootloader.h)
+ *  is 0x01 the test runs at every reset too and the first part of the
+ *  block goes out as if node 0 had asked.
+ */
+
+#ifndef _BL_SELFTEST_H
+#define _BL_SELFTEST_H
+
+#include "bootloader.h"
+
+#ifdef BL_SELFTEST
+
+#define SELFTEST_FRAMES 64  /* Frames in the burst */
+#define SELFTEST_SPI    256 /* Register reads that spi_ns is timed over */
+#define SELFTEST_WAIT   ((uint16_t)(BOOT_F_CPU / 1024 / 100)) /* Timer 1 ticks to wait for a frame to come back (~10mS) */
+
+/* nS per Timer 1 tick */
+#define SELFTEST_TICK_NS (1024000000UL / (BOOT_F_CPU / 1000))
+
+/* This is sent as it is so don't change the order.  Everything is
+   least significant byte first. */
+struct SelfTest {
+    uint8_t sent;            /* Frames that went out */
+    uint8_t received;        /* Frames that came back the same */
+    uint8_t errors;          /* Frames that came back different */
+    uint8_t mode;            /* can_mode() afterwards, CAN_MODE_NORMAL unless it's stuck */
+    uint32_t burst_us;       /* From the first can_send() to the last can_read() */
+    uint16_t frames_per_sec;
+    uint32_t spi_ns;         /* One register read with can_poll_int() */
+};
+extern struct SelfTest bl_selftest;
+
+#endif /* BL_SELFTEST */
+
+#endif
@@ -0,0 +1,66 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Session log.  Every time load_firmware() finishes it writes a record
+ *  of how the update went to a ring at the top of the EEPROM, so that
+ *  it's still there after the node has reset into the new firmware.  The
+ *  application must not use the last SESSION_RECORDS * 16 bytes of the
+ *  EEPROM.  EEPROM Write (0x09) doesn't write them either.  Bytes of an
+ *  EEPROM image that fall in the ring are dropped, so reading them back
+ *  won't match the image.
+ *
+ *  The ring is read with the FIX_BL_LOG node specific query the same way
+ *  as the FIX_BL_STATS counters (see fix.h).  data[2] is the byte offset
+ *  into the ring.  The records are in the order they were written in
+ *  the EEPROM, not newest first, so use seq to put them in order.  A
+ *  record with 0xFF for a result has never been written.
+ */
+
+#ifndef _BL_SESSION_H
+#define _BL_SESSION_H
+
+#include "bootloader.h"
+
+#ifdef BL_SESSION_LOG
+
+#define SESSION_RECORDS 8
+#define EE_SESSION_LOG  (E2END + 1 - SESSION_RECORDS * sizeof(struct SessionRecord))
+
+/* How the session ended */
+#define SESSION_COMPLETE 0x01 /* Complete command, the new CRC is stored */
+#define SESSION_RESET    0x02 /* Reset command */
+#define SESSION_GAVE_UP  0x03 /* Nothing on the channel for too long */
+
+/* This is read as it is so don't change the order.  The times are
+   Timer 1 ticks (clk/1024).  start is the count when the firmware
+   request came in, which is the time since reset if it was during the
+   startup wait, and end is start plus however long the load took.
+   Everything is least significant byte first. */
+struct SessionRecord {
+    uint8_t seq;       /* One more than the record before it */
+    uint8_t result;
+    uint16_t start;    /* When the firmware request came in */
+    uint32_t end;
+    uint16_t pages;    /* Page Write and Merge Write commands */
+    uint16_t resent;   /* Fill Buffer commands for a page we'd already had */
+    uint16_t timeouts; /* Waits on the channel that timed out */
+    uint16_t crc;      /* From the Complete command or 0xFFFF */
+};
+
+#endif /* BL_SESSION_LOG */
+
+#endif
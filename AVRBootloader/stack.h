@@ -0,0 +1,128 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stack painting.  At reset util.S fills everything from the end of
+ *  .bss up to RAMEND with STACK_PATTERN.  Whatever isn't the pattern
+ *  anymore has been used by the stack, so the lowest byte that changed
+ *  is the high water mark.
+ *
+ *  The exported functions run on the application's stack so we also
+ *  measure each of them.  STACK_COST() goes around a call that the
+ *  bootloader makes to one of them.  First it paints everything below
+ *  the stack pointer again, since the rest of the bootloader has been
+ *  using it too.  Afterwards it looks at how far below the stack pointer
+ *  the call went, keeps the biggest, and paints that part again.  All of
+ *  that is inlined so that nothing but the call itself goes below the
+ *  stack pointer.  The bootloader doesn't call the CAN queue or flash CRC
+ *  functions itself, so the ones that don't need the CAN controller are
+ *  called once at startup to measure them.  canq_filter(), canq_send()
+ *  and canq_service() are never measured and stay at zero.  A UART
+ *  interrupt in the middle of a call counts against it too.
+ *
+ *  The numbers are read with the FIX_BL_STACK node specific query, the
+ *  same way as the FIX_BL_STATS counters (see fix.h).
+ */
+
+#ifndef _BL_STACK_H
+#define _BL_STACK_H
+
+#include "bootloader.h"
+
+#define STACK_PATTERN 0xC5
+
+#ifndef __ASSEMBLER__
+#ifdef BL_STACK_PAINT
+
+/* The index into cost[] is one less than the function's place in the
+   jump table, see boot_util.h */
+#define STK_INIT_SPI       0
+#define STK_SPI_WRITE      1
+#define STK_CAN_INIT       2
+#define STK_CAN_READ       3
+#define STK_CAN_SEND       4
+#define STK_CAN_MODE       5
+#define STK_CAN_MASK       6
+#define STK_CAN_FILTER     7
+#define STK_CANQ_INIT      8
+#define STK_CANQ_FILTER    9
+#define STK_CANQ_SEND      10
+#define STK_CANQ_RECV      11
+#define STK_CANQ_SERVICE   12
+#define STK_FLASHCRC_BEGIN 13
+#define STK_FLASHCRC_STEP  14
+#define STK_COUNT          15
+
+/* This is sent as it is so don't change the order.  The 16 bit values
+   are least significant byte first. */
+struct BlStack {
+    uint16_t high_water;     /* Most bytes of stack used since reset */
+    uint16_t free;           /* Bytes above .bss that the stack never got to */
+    uint8_t cost[STK_COUNT]; /* Most stack used by each exported function */
+};
+extern struct BlStack bl_stack;
+extern uint8_t _end; /* The end of .bss from the linker */
+
+/* Finds the lowest byte that the stack has used since it was last
+   painted and updates the high water mark */
+static inline __attribute__((always_inline)) uint8_t *
+stack_low(void)
+{
+    uint8_t *p = &_end;
+
+    while(p <= (uint8_t *)RAMEND && *p == STACK_PATTERN) p++;
+    if(RAMEND + 1 - (uint16_t)p > bl_stack.high_water) {
+        bl_stack.high_water = RAMEND + 1 - (uint16_t)p;
+        bl_stack.free = (uint16_t)p - (uint16_t)&_end;
+    }
+    return p;
+}
+
+/* Paints from p up to the stack pointer */
+static inline __attribute__((always_inline)) void
+stack_paint(uint8_t *p)
+{
+    while(p < (uint8_t *)SP) *p++ = STACK_PATTERN;
+}
+
+/* After the call to exported function n.  sp is the stack pointer from
+   before the call.  Everything below our own frame is free again so it
+   gets painted for the next one. */
+static inline __attribute__((always_inline)) void
+stack_cost(uint8_t n, uint8_t *sp)
+{
+    uint8_t *p = stack_low();
+
+    if(sp + 1 - p > bl_stack.cost[n]) bl_stack.cost[n] = sp + 1 - p > 0xFF ? 0xFF : sp + 1 - p;
+    stack_paint(p);
+}
+
+#define STACK_COST(n, stmt) do { \
+        uint8_t *_sp; \
+        stack_paint(stack_low()); \
+        _sp = (uint8_t *)SP; \
+        stmt; \
+        stack_cost(n, _sp); \
+    } while(0)
+
+#else
+
+#define STACK_COST(n, stmt) stmt
+
+#endif /* BL_STACK_PAINT */
+#endif /* __ASSEMBLER__ */
+
+#endif
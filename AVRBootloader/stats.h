@@ -0,0 +1,62 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Performance counters.  These count what the bootloader did since it
+ *  started so that we can see how a firmware update went without having
+ *  a serial cable hooked up.  They are read with the FIX_BL_STATS node
+ *  specific query (see fix.h).  Comment out BL_STATS in bootloader.h and
+ *  all of this goes away.
+ */
+
+#ifndef _BL_STATS_H
+#define _BL_STATS_H
+
+#include "bootloader.h"
+
+#ifdef BL_STATS
+
+/* This is sent as it is so don't change the order.  All of the counters
+   are 16 bits, least significant byte first, and wrap around. */
+struct BlStats {
+    uint16_t rx_frames;  /* Frames read out of the CAN controller */
+    uint16_t rx_ignored; /* Frames that weren't for us */
+    uint16_t timeouts;   /* Waits on the firmware channel that timed out */
+    uint16_t tx_busy;    /* can_send() calls that found the buffer still busy */
+    uint16_t spi;        /* SPI transactions */
+    uint16_t erases;     /* Pages erased */
+    uint16_t writes;     /* Pages written */
+    uint16_t spm_wait;   /* Timer 1 ticks spent waiting for the flash */
+};
+extern struct BlStats bl_stats;
+
+/* The CAN and SPI functions are also called by the application through
+   the jump table and then bl_stats is some of the application's SRAM.
+   The interrupt vectors are only moved to the boot section while the
+   bootloader is running so we use IVSEL to tell who called us. */
+#define STAT_INC(x) do { if(MCUCR & (1<<IVSEL)) bl_stats.x++; } while(0)
+
+/* Adds the Timer 1 ticks that it takes to do stmt to counter x */
+#define STAT_TIME(x, stmt) do { uint16_t _start = TCNT1; stmt; bl_stats.x += TCNT1 - _start; } while(0)
+
+#else
+
+#define STAT_INC(x)
+#define STAT_TIME(x, stmt) stmt
+
+#endif /* BL_STATS */
+
+#endif
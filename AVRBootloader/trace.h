@@ -0,0 +1,70 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Event trace.  The bootloader keeps the last TRACE_SIZE events in a
+ *  ring buffer in SRAM, each with the Timer 1 count when it happened.
+ *  Timer 1 runs at clk/1024 so a tick is 128uS at 8MHz.  The count is
+ *  set back to zero at the end of the one second startup wait.
+ *
+ *  The response to the Trace Dump command (0x06) on the firmware channel
+ *  is the ring, oldest event first, in as many frames as it takes.  Each
+ *  frame is 0x06, the number of events still to come after this frame
+ *  and then three bytes per event: the event code below and the time,
+ *  least significant byte first.  The last frame has a zero in the
+ *  second byte.  With UART_DEBUG the ring is also printed when a
+ *  firmware load ends.
+ */
+
+#ifndef _BL_TRACE_H
+#define _BL_TRACE_H
+
+#include "bootloader.h"
+
+#ifdef BL_TRACE
+
+#if TRACE_SIZE > 128 || (TRACE_SIZE & (TRACE_SIZE - 1))
+  #error "TRACE_SIZE has to be a power of two no bigger than 128"
+#endif
+
+#define TR_RX          0x01 /* Frame received on the firmware channel */
+#define TR_ACK         0x02 /* Response sent on the firmware channel */
+#define TR_ERASE_START 0x03
+#define TR_ERASE_END   0x04
+#define TR_WRITE_START 0x05
+#define TR_WRITE_END   0x06
+#define TR_TIMEOUT     0x07 /* Nothing on the firmware channel */
+#define TR_CRC_START   0x08
+#define TR_CRC_END     0x09
+
+struct TraceEvent {
+    uint8_t event;
+    uint16_t time;
+};
+
+#define TRACE(event) trace(event)
+#define TRACE_SPM(start) trace_spm(start)
+#define TRACE_SPM_CHECK() trace_spm_check()
+
+#else
+
+#define TRACE(event)
+#define TRACE_SPM(start)
+#define TRACE_SPM_CHECK()
+
+#endif /* BL_TRACE */
+
+#endif
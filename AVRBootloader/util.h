@@ -70,11 +70,29 @@
 #define BITISSET(x,y) (((x) & (y)) == (y))
 #define BITISCLEAR(x,y) (((x) & (y)) == 0)
 
-/* cutil.c function */
+/* Reads a byte from a table that is stored in the bootloader's flash.
+   On the bigger parts the bootloader is above 64K so the far read has
+   to be used. */
+#if FLASHEND > 0xFFFF
+  #define pgm_read_table(table, offset) pgm_read_byte_far(pgm_get_far_address(table) + (offset))
+#else
+  #define pgm_read_table(table, offset) pgm_read_byte_near((const uint8_t *)(table) + (offset))
+#endif
+
+/* Reads a byte of the application section at address */
+#if FLASHEND > 0xFFFF
+  #define pgm_read_app(address) pgm_read_byte_far(address)
+#else
+  #define pgm_read_app(address) pgm_read_byte_near(address)
+#endif
+
+#ifndef __ASSEMBLER__
+/* cutil.c function (util.S in the MinSize build) */
 void spi_write(uint8_t *write_buff, uint8_t *read_buff, uint8_t size);
 
 /* util.S functions */
 void start_app(void);
 void reset(void);
+#endif
 
 #endif
@@ -0,0 +1,522 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Firmware images and the frames that load_firmware() in main.c wants
+ *  for them.  The host tools share this.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fwimage.h"
+
+const struct fw_part fw_parts[] = {
+    {"328p", 128, 0x7000, 1024},
+    {"2561", 256, 0x3F000, 4096},
+    {NULL, 0, 0, 0}
+};
+
+const struct fw_part *
+fw_find_part(const char *name)
+{
+    const struct fw_part *p;
+
+    for(p = fw_parts; p->name != NULL && strcmp(p->name, name) != 0; p++);
+    return p->name != NULL ? p : NULL;
+}
+
+uint16_t
+fw_crc16(const uint8_t *p, uint32_t n)
+{
+    uint16_t crc = 0xFFFF;
+    int i;
+
+    while(n--) {
+        crc ^= *p++;
+        for(i = 0; i < 8; i++) crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+static int
+hex_byte(const char *s)
+{
+    unsigned v;
+
+    if(sscanf(s, "%2x", &v) != 1) return -1;
+    return v;
+}
+
+/* Reads an Intel HEX file into image and sets the bytes in used that it
+   has data for.  Returns the size of the program, which is one more than
+   the highest address, or -1. */
+static long
+load_hex(FILE *f, uint8_t *image, uint8_t *used, uint32_t max)
+{
+    char line[600];
+    uint32_t base = 0, addr, size = 0;
+    int count, type, i, b, sum;
+
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] != ':') continue;
+        count = hex_byte(line + 1);
+        addr = hex_byte(line + 3) << 8 | hex_byte(line + 5);
+        type = hex_byte(line + 7);
+        if(count < 0 || type < 0 || strlen(line) < 11 + 2 * (size_t)count) return -1;
+        for(sum = 0, i = 0; i < count + 5; i++) sum += hex_byte(line + 1 + 2 * i);
+        if(sum & 0xFF) {
+            fprintf(stderr, "Bad checksum in: %s", line);
+            return -1;
+        }
+        if(type == 0x00) {
+            for(i = 0; i < count; i++) {
+                b = hex_byte(line + 9 + 2 * i);
+                if(base + addr + i >= max) {
+                    fprintf(stderr, "Address 0x%X is past the end of the application section\n",
+                            base + addr + i);
+                    return -1;
+                }
+                image[base + addr + i] = b;
+                if(used != NULL) used[base + addr + i] = 1;
+                if(base + addr + i + 1 > size) size = base + addr + i + 1;
+            }
+        } else if(type == 0x01) {
+            break;
+        } else if(type == 0x02) {
+            base = (hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 4;
+        } else if(type == 0x04) {
+            base = (uint32_t)(hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 16;
+        }
+    }
+    return size;
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Reads the flash part of an AVR ELF file.  Each loadable segment goes
+   in at its physical address, which is where avr-objcopy would put it in
+   a HEX file, so .data ends up after .text.  Anything at 0x800000 and
+   up is SRAM or EEPROM and isn't ours.  Returns the same as load_hex(). */
+static long
+load_elf(FILE *f, uint8_t *image, uint8_t *used, uint32_t max)
+{
+    uint8_t eh[52], ph[32];
+    uint32_t offset, addr, filesz, size = 0;
+    int phnum, phentsize, i;
+
+    if(fread(eh, 1, sizeof(eh), f) != sizeof(eh) || eh[4] != 1 || eh[5] != 1 ||
+       (eh[18] | eh[19] << 8) != 83) {
+        fprintf(stderr, "Not a 32 bit little endian AVR ELF file\n");
+        return -1;
+    }
+    phentsize = eh[42] | eh[43] << 8;
+    phnum = eh[44] | eh[45] << 8;
+    for(i = 0; i < phnum; i++) {
+        if(phentsize < (int)sizeof(ph) || fseek(f, get32(&eh[28]) + i * phentsize, SEEK_SET) != 0 ||
+           fread(ph, 1, sizeof(ph), f) != sizeof(ph)) return -1;
+        offset = get32(&ph[4]);
+        addr = get32(&ph[12]);
+        filesz = get32(&ph[16]);
+        if(get32(&ph[0]) != 1 || filesz == 0 || addr >= 0x800000) continue; /* PT_LOAD */
+        if(addr + filesz > max) {
+            fprintf(stderr, "Address 0x%X is past the end of the application section\n",
+                    addr + filesz - 1);
+            return -1;
+        }
+        if(fseek(f, offset, SEEK_SET) != 0 || fread(image + addr, 1, filesz, f) != filesz) return -1;
+        if(used != NULL) memset(used + addr, 1, filesz);
+        if(addr + filesz > size) size = addr + filesz;
+    }
+    return size;
+}
+
+long
+fw_load(const char *path, uint8_t *image, uint32_t max)
+{
+    return fw_load_used(path, image, NULL, max);
+}
+
+long
+fw_load_used(const char *path, uint8_t *image, uint8_t *used, uint32_t max)
+{
+    FILE *f;
+    long size;
+    int c;
+
+    f = fopen(path, "rb");
+    if(f == NULL) {
+        perror(path);
+        return -1;
+    }
+    c = fgetc(f);
+    ungetc(c, f);
+    if(c == ':') {
+        size = load_hex(f, image, used, max);
+    } else if(c == 0x7F) {
+        size = load_elf(f, image, used, max);
+    } else {
+        size = fread(image, 1, max, f);
+        if(fgetc(f) != EOF) {
+            fprintf(stderr, "%s is too big\n", path);
+            size = -1;
+        }
+        if(size > 0 && used != NULL) memset(used, 1, size);
+    }
+    fclose(f);
+    return size;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static struct op *
+add_op(struct op *ops, int *count, int page, uint8_t cmd, uint32_t addr)
+{
+    struct op *op = &ops[(*count)++];
+
+    memset(op, 0, sizeof(*op));
+    op->page = page;
+    op->data[0] = cmd;
+    put32(&op->data[1], addr);
+    op->length = 5;
+    return op;
+}
+
+/* Commands are answered with the same frame */
+static void
+echo_acks(struct op *ops, int count)
+{
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(ops[i].ack_length == 0) {
+            memcpy(ops[i].ack, ops[i].data, ops[i].length);
+            ops[i].ack_length = ops[i].length;
+        }
+    }
+}
+
+/* Changed bytes this close together go in one Fill.  The gap costs
+   less to send again than another Fill would. */
+#define MERGE_GAP 8
+
+/* CAN FD frames over 8 bytes can only be 12, 16, 20, 24, 32, 48 or 64
+   bytes long.  Anything else gets padded out to the next one and the node
+   would take the padding as data.  This is the most of n that fits. */
+static uint32_t
+fd_length(uint32_t n)
+{
+    static const uint8_t lengths[] = { 64, 48, 32, 24, 20, 16, 12, 8 };
+    int i;
+
+    if(n <= 8) return n;
+    for(i = 0; lengths[i] > n; i++);
+    return lengths[i];
+}
+
+/* A Fill, or an EEPROM Write, for length bytes at addr and the buffer
+   data for them */
+static void
+add_fill(struct op *ops, int *count, int page, uint8_t cmd, const uint8_t *image,
+         uint32_t addr, uint32_t length, uint32_t chunk, int fd)
+{
+    struct op *op;
+    uint32_t off, n;
+
+    op = add_op(ops, count, page, cmd, addr);
+    op->data[5] = length;
+    op->data[6] = length >> 8;
+    op->length = 7;
+    for(off = 0; off < length; off += n) {
+        n = length - off < chunk ? length - off : chunk;
+        if(fd) n = fd_length(n);
+        op = &ops[(*count)++];
+        memset(op, 0, sizeof(*op));
+        op->page = page;
+        op->fd = fd;
+        memcpy(op->data, image + addr + off, n);
+        op->length = n;
+        /* The answer to buffer data is how much of the page we have */
+        op->ack[0] = (off + n);
+        op->ack[1] = (off + n) >> 8;
+        op->ack_length = 2;
+        op->wait = off == 0;
+    }
+}
+
+/* A Fill for every run of bytes that changed in the page at base and a
+   Merge Write.  A Fill that comes after data waits for it the same as
+   the Write does.  Returns 1 without adding anything past the runs before
+   it if a run is the whole page.  The node takes a whole page Fill as the
+   page changing and it has to be sent with Erase and Write. */
+static int
+add_merge(struct op *ops, int *count, int page, const uint8_t *image, const uint8_t *old,
+          uint32_t base, uint32_t page_size, uint32_t chunk, int fd)
+{
+    uint32_t i, start, end;
+    int first = *count;
+    struct op *op;
+
+    for(i = 0; i < page_size; i++) {
+        if(image[base + i] == old[base + i]) continue;
+        start = end = i;
+        for(i++; i < page_size && i <= end + MERGE_GAP; i++) {
+            if(image[base + i] != old[base + i]) end = i;
+        }
+        i = end;
+        if(start == 0 && end == page_size - 1) return 1;
+        op = &ops[*count];
+        add_fill(ops, count, page, CMD_FILL, image, base + start, end - start + 1, chunk, fd);
+        op->wait = op != &ops[first];
+    }
+    op = add_op(ops, count, page, CMD_MERGE, base);
+    op->wait = 1;
+    return 0;
+}
+
+struct op *
+fw_ops(const uint8_t *image, const uint8_t *old, uint32_t size,
+       uint32_t page_size, int fd, int *count)
+{
+    uint32_t pages = (size + page_size - 1) / page_size;
+    uint32_t chunk = fd ? 64 : 8, p, base, i;
+    struct op *ops, *op;
+    uint16_t crc;
+    int mark;
+
+    /* A merged page can take a few more frames than a whole one before
+       we give up on it.  The end of a run can take three CAN FD frames. */
+    ops = malloc(sizeof(*ops) * (pages * (4 + page_size / chunk +
+                                          (fd ? 4 : 2) * (page_size / (MERGE_GAP + 1) + 1)) + 1));
+    if(ops == NULL) return NULL;
+    *count = 0;
+    for(p = 0; p < pages; p++) {
+        base = p * page_size;
+        for(i = 0; i < page_size && image[base + i] == 0xFF; i++);
+        if(old != NULL) {
+            if(memcmp(image + base, old + base, page_size) == 0) continue;
+            if(i < page_size) {
+                mark = *count;
+                if(add_merge(ops, count, p, image, old, base, page_size, chunk, fd) == 0 &&
+                   *count - mark < 3 + (int)(page_size / chunk)) continue;
+                *count = mark; /* Cheaper to send all of it */
+            }
+        }
+        add_op(ops, count, p, CMD_ERASE, base);
+        if(i == page_size) continue; /* Erasing it is all it needs */
+        add_fill(ops, count, p, CMD_FILL, image, base, page_size, chunk, fd);
+        op = add_op(ops, count, p, CMD_WRITE, base);
+        op->wait = 1;
+    }
+    crc = fw_crc16(image, size);
+    op = add_op(ops, count, -1, CMD_COMPLETE, 0);
+    op->data[1] = crc;
+    op->data[2] = crc >> 8;
+    put32(&op->data[3], size);
+    op->length = 7;
+    op->wait = 1;
+    echo_acks(ops, *count);
+    return ops;
+}
+
+struct op *
+fw_eeprom_ops(const uint8_t *image, const uint8_t *used, uint32_t size, int fd, int reset, int *count)
+{
+    uint32_t chunk = fd ? 64 : 8, i, start, n, addr;
+    struct op *ops, *op;
+    int first;
+
+    /* Every other byte could be a run of its own */
+    ops = malloc(sizeof(*ops) * (3 * size + 2));
+    if(ops == NULL) return NULL;
+    *count = 0;
+    for(i = 0; i < size; i++) {
+        if(!used[i]) continue;
+        for(start = i; i < size && used[i]; i++);
+        first = *count;
+        add_fill(ops, count, -2, CMD_EE_WRITE, image, start, i - start, chunk, fd);
+        ops[first].wait = first > 0; /* It would be taken for data */
+    }
+    /* Then read all of it back */
+    first = *count;
+    for(i = 0; i < size; i++) {
+        if(!used[i]) continue;
+        for(addr = i, n = 0; i < size && used[i] && n < FW_EE_READ; i++, n++);
+        op = add_op(ops, count, -2, CMD_EE_READ, addr);
+        op->data[5] = n;
+        op->length = 6;
+        op->ack[0] = CMD_EE_READ;
+        op->ack[1] = addr;
+        op->ack[2] = addr >> 8;
+        memcpy(&op->ack[3], image + addr, n);
+        op->ack_length = 3 + n;
+        op->wait = *count - 1 == first;
+        i--;
+    }
+    if(reset) {
+        op = add_op(ops, count, -1, CMD_RESET, 0);
+        op->wait = 1;
+    }
+    echo_acks(ops, *count);
+    return ops;
+}
+
+void
+fw_pacing(struct op *op, int page, uint8_t priority, uint8_t pace, uint8_t report)
+{
+    memset(op, 0, sizeof(*op));
+    op->page = page;
+    op->data[0] = CMD_PACING;
+    op->data[1] = priority;
+    op->data[2] = pace;
+    op->data[3] = report;
+    op->length = 4;
+    memcpy(op->ack, op->data, op->length);
+    op->ack_length = op->length;
+}
+
+int
+fw_ack_matches(const struct op *op, const struct canfd_frame *cf)
+{
+    /* The Pacing report adds three bytes to the buffer data answers */
+    if(op->ack_length == 2 && cf->len == 5) return memcmp(cf->data, op->ack, 2) == 0;
+    return cf->len == op->ack_length && memcmp(cf->data, op->ack, op->ack_length) == 0;
+}
+
+/* A plan is the header
+
+     FW_PLAN_MAGIC, page_size (4), size (4), crc (2), fd (1), 0 (1), count (4)
+
+   and then for each frame
+
+     page (2), flags (1), length (1), data, and unless flags has
+     PLAN_ECHO, ack_length (1) and ack
+
+   Everything is least significant byte first. */
+#define PLAN_FD   0x01
+#define PLAN_WAIT 0x02
+#define PLAN_ECHO 0x04 /* The answer is the same as the frame */
+
+int
+fw_is_plan(const char *path)
+{
+    char magic[8];
+    FILE *f = fopen(path, "rb");
+
+    if(f == NULL) return 0;
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic)) magic[0] = 0;
+    fclose(f);
+    return memcmp(magic, FW_PLAN_MAGIC, sizeof(magic)) == 0;
+}
+
+int
+fw_plan_save(const char *path, const struct fw_plan *plan, const struct op *ops, int count)
+{
+    uint8_t head[24], b[5];
+    FILE *f;
+    int k, echo;
+
+    f = fopen(path, "wb");
+    if(f == NULL) {
+        perror(path);
+        return -1;
+    }
+    memcpy(head, FW_PLAN_MAGIC, 8);
+    put32(&head[8], plan->page_size);
+    put32(&head[12], plan->size);
+    head[16] = plan->crc;
+    head[17] = plan->crc >> 8;
+    head[18] = plan->fd;
+    head[19] = 0;
+    put32(&head[20], count);
+    fwrite(head, 1, sizeof(head), f);
+    for(k = 0; k < count; k++) {
+        echo = ops[k].ack_length == ops[k].length && memcmp(ops[k].ack, ops[k].data, ops[k].length) == 0;
+        b[0] = ops[k].page;
+        b[1] = ops[k].page >> 8;
+        b[2] = (ops[k].fd ? PLAN_FD : 0) | (ops[k].wait ? PLAN_WAIT : 0) | (echo ? PLAN_ECHO : 0);
+        b[3] = ops[k].length;
+        b[4] = ops[k].ack_length;
+        fwrite(b, 1, 4, f);
+        fwrite(ops[k].data, 1, ops[k].length, f);
+        if(!echo) {
+            fwrite(&b[4], 1, 1, f);
+            fwrite(ops[k].ack, 1, ops[k].ack_length, f);
+        }
+    }
+    if(fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+struct op *
+fw_plan_load(const char *path, struct fw_plan *plan, int *count)
+{
+    uint8_t head[24], b[4];
+    struct op *ops, *op;
+    FILE *f;
+    int k;
+
+    f = fopen(path, "rb");
+    if(f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if(fread(head, 1, sizeof(head), f) != sizeof(head) || memcmp(head, FW_PLAN_MAGIC, 8) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    plan->page_size = get32(&head[8]);
+    plan->size = get32(&head[12]);
+    plan->crc = head[16] | head[17] << 8;
+    plan->fd = head[18];
+    *count = get32(&head[20]);
+    ops = *count > 0 && *count < 0x100000 ? calloc(*count, sizeof(*ops)) : NULL;
+    for(k = 0; ops != NULL && k < *count; k++) {
+        op = &ops[k];
+        if(fread(b, 1, 4, f) != 4 || b[3] > sizeof(op->data) ||
+           fread(op->data, 1, b[3], f) != b[3]) break;
+        op->page = (int16_t)(b[0] | b[1] << 8);
+        op->fd = (b[2] & PLAN_FD) != 0;
+        op->wait = (b[2] & PLAN_WAIT) != 0;
+        op->length = b[3];
+        if(b[2] & PLAN_ECHO) {
+            if(op->length > sizeof(op->ack)) break;
+            memcpy(op->ack, op->data, op->length);
+            op->ack_length = op->length;
+        } else if(fread(&op->ack_length, 1, 1, f) != 1 || op->ack_length > sizeof(op->ack) ||
+                  fread(op->ack, 1, op->ack_length, f) != op->ack_length) {
+            break;
+        }
+    }
+    fclose(f);
+    if(ops == NULL || k < *count) {
+        fprintf(stderr, "%s: the transfer plan is cut short or damaged\n", path);
+        free(ops);
+        return NULL;
+    }
+    return ops;
+}
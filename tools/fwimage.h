@@ -0,0 +1,145 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Firmware images and the frames that load_firmware() in main.c wants
+ *  for them.  The host tools share this.
+ */
+
+#ifndef FWIMAGE_H
+#define FWIMAGE_H
+
+#include <stdint.h>
+#include <linux/can.h>
+
+/* Commands on the two way channel */
+#define CMD_FILL     0x01
+#define CMD_ERASE    0x02
+#define CMD_WRITE    0x03
+#define CMD_ABORT    0x04
+#define CMD_COMPLETE 0x05
+#define CMD_MERGE    0x07
+#define CMD_PACING   0x08
+#define CMD_EE_WRITE 0x09
+#define CMD_EE_READ  0x0A
+#define CMD_RESET    0x0B
+
+/* Bytes in each EEPROM Read.  The answer has three bytes of its own and
+   has to fit in a classic frame. */
+#define FW_EE_READ   5
+
+/* A part that the bootloader runs on */
+struct fw_part {
+    const char *name;
+    uint32_t page_size;
+    uint32_t app_size;  /* Where the boot section starts */
+    uint32_t eeprom_size;
+};
+
+/* The first one is the default */
+extern const struct fw_part fw_parts[];
+
+/* Returns the part called name, like "328p", or NULL */
+const struct fw_part *fw_find_part(const char *name);
+
+/* One frame of the upload and the answer that we expect for it */
+struct op {
+    uint8_t data[64];
+    uint8_t length;
+    uint8_t fd;
+    uint8_t ack[8];
+    uint8_t ack_length;
+    uint8_t wait;      /* Doesn't go out until everything before it is answered */
+    int page;          /* -1 for the Complete command */
+    double sent;
+};
+
+/* The same CRC16 that pgmcrc() works out on the node */
+uint16_t fw_crc16(const uint8_t *p, uint32_t n);
+
+/* Reads Intel HEX if the file starts with a ':', the flash segments of
+   an AVR ELF file if it starts with 0x7F and a raw binary otherwise.
+   image has to be max bytes and filled with 0xFF.  Returns the size of
+   the program, which is one more than the highest address, or -1. */
+long fw_load(const char *path, uint8_t *image, uint32_t max);
+
+/* The same but it also sets the bytes in used, which has to be max
+   bytes of zeros, that the file has data for.  A HEX file doesn't have
+   to have all of them. */
+long fw_load_used(const char *path, uint8_t *image, uint8_t *used, uint32_t max);
+
+/* Every frame of the upload in the order that they go out.  The buffer
+   data goes in 64 byte CAN FD frames if fd is set.  Returns a malloc()ed
+   array of *count frames or NULL.
+
+   If old isn't NULL it's what the node has now and only what changed
+   goes out.  Pages that are the same are left alone and pages where only
+   a few bytes changed get a Fill for each run of changed bytes and a
+   Merge Write, which needs BL_MERGE on the node.  Both images have to be
+   page_size past size.  A page that's all 0xFF only gets an Erase.
+
+   The answers have to come back in the same order as the frames, and
+   one that skips a frame means that something got lost.  That doesn't
+   work for the buffer data because the answer is only how much of the
+   page the node has, so the answer to the frame after a lost one looks
+   like the answer to the lost one.  So the Write waits until all of the
+   data is answered, and the data waits for the Fill so that it can't be
+   taken for a command.  Complete waits so that it can't go out ahead of
+   a Write that got lost. */
+struct op *fw_ops(const uint8_t *image, const uint8_t *old, uint32_t size,
+                  uint32_t page_size, int fd, int *count);
+
+/* The frames to write the bytes in image that are set in used to the
+   EEPROM and then read them all back to check them.  The node skips the
+   ones that are already right.  With reset set a Reset command goes
+   last, for when there is no firmware and so no Complete.  Returns a
+   malloc()ed array of *count frames or NULL. */
+struct op *fw_eeprom_ops(const uint8_t *image, const uint8_t *used, uint32_t size, int fd,
+                         int reset, int *count);
+
+/* Makes op the Pacing command.  The node's answers go out at priority
+   0-3, at least pace mS apart, and with report set the buffer data
+   answers have the node's transmit and receive error counters and how
+   many of its answers since the last one lost arbitration or had an
+   error. */
+void fw_pacing(struct op *op, int page, uint8_t priority, uint8_t pace, uint8_t report);
+
+/* Returns 1 if cf is the answer that op is waiting for */
+int fw_ack_matches(const struct op *op, const struct canfd_frame *cf);
+
+/* A transfer plan is every frame of an upload worked out ahead of time
+   by canfix-pack (see pack.c) so the uploader only has to send it.  The
+   file starts with FW_PLAN_MAGIC. */
+#define FW_PLAN_MAGIC "CFXPLAN1"
+
+struct fw_plan {
+    uint32_t page_size;
+    uint32_t size;      /* The program size in the Complete command */
+    uint16_t crc;
+    uint8_t fd;         /* The buffer data is in CAN FD frames */
+};
+
+/* Returns 1 if path is a transfer plan */
+int fw_is_plan(const char *path);
+
+/* Writes count frames and plan to path.  Returns 0 or -1. */
+int fw_plan_save(const char *path, const struct fw_plan *plan, const struct op *ops, int count);
+
+/* Reads a transfer plan into plan.  Returns a malloc()ed array of
+   *count frames or NULL. */
+struct op *fw_plan_load(const char *path, struct fw_plan *plan, int *count);
+
+#endif
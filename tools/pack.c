@@ -0,0 +1,122 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Packs a firmware image into a transfer plan, every frame that
+ *  load_firmware() in main.c wants for it worked out ahead of time, so
+ *  canfix-upload (or anything else that can read fwimage.h) only has to
+ *  send it.  The image can be Intel HEX, an AVR ELF file or a raw
+ *  binary.  Everything goes on the part's page boundaries, pages that
+ *  are all 0xFF only get an Erase, and the CRC and size for the Complete
+ *  command are worked out here.  -o works the same as it does for
+ *  canfix-upload, the plan only has what changed since the old image.
+ *  -F has to match between the two.
+ *
+ *  Build it from the top of the repository with
+ *
+ *    gcc -O2 -Wall -std=gnu99 -IAVRBootloader -Itools -o canfix-pack \
+ *        tools/pack.c tools/fwimage.c
+ *
+ *  and then
+ *
+ *    ./canfix-pack firmware.elf firmware.plan
+ *    ./canfix-upload -i vcan0 -n 0x22 firmware.plan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "fwimage.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: canfix-pack [options] firmware plan\n"
+                    "  -m part, 328p or 2561 (328p)\n"
+                    "  -o file the node has now, only what changed goes in the plan\n"
+                    "  -F puts the buffer data in 64 byte CAN FD frames\n"
+                    "  -q only prints errors\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct fw_part *part = &fw_parts[0];
+    const char *old_path = NULL;
+    struct fw_plan plan;
+    struct op *ops;
+    uint8_t *image, *old = NULL;
+    long size, old_size = 0, bytes = 0;
+    int fd = 0, quiet = 0, c, count, k, pages = 0, erased = 0;
+
+    while((c = getopt(argc, argv, "m:o:Fq")) != -1) {
+        switch(c) {
+        case 'm':
+            part = fw_find_part(optarg);
+            if(part == NULL) usage();
+            break;
+        case 'o': old_path = optarg; break;
+        case 'F': fd = 1; break;
+        case 'q': quiet = 1; break;
+        default: usage();
+        }
+    }
+    if(argc - optind != 2) usage();
+
+    image = malloc(part->app_size);
+    if(image == NULL) return 1;
+    memset(image, 0xFF, part->app_size);
+    if(old_path != NULL) {
+        old = malloc(part->app_size);
+        if(old == NULL) return 1;
+        memset(old, 0xFF, part->app_size);
+        old_size = fw_load(old_path, old, part->app_size);
+        if(old_size < 0) return 1;
+        memcpy(image, old, part->app_size);
+    }
+    size = fw_load(argv[optind], image, part->app_size);
+    if(size < 0) return 1;
+    if(size < old_size) size = old_size;
+    if(size == 0) {
+        fprintf(stderr, "%s is empty\n", argv[optind]);
+        return 1;
+    }
+    ops = fw_ops(image, old, size, part->page_size, fd, &count);
+    if(ops == NULL) return 1;
+    plan.page_size = part->page_size;
+    plan.size = size;
+    plan.crc = fw_crc16(image, size);
+    plan.fd = fd;
+    if(fw_plan_save(argv[optind + 1], &plan, ops, count) < 0) return 1;
+    if(!quiet) {
+        for(k = 0; k < count; k++) {
+            bytes += ops[k].length;
+            if(ops[k].page < 0 || (k > 0 && ops[k].page == ops[k - 1].page)) continue;
+            pages++;
+            if(k + 1 == count || ops[k + 1].page != ops[k].page) erased++; /* Only an Erase */
+        }
+        printf("%s: %ld bytes, CRC 0x%04X\n", argv[optind], size, plan.crc);
+        printf("%s: %d pages, %d of them only erased, %d frames with %ld bytes of data\n",
+               argv[optind + 1], pages, erased, count, bytes);
+    }
+    free(ops);
+    free(image);
+    free(old);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stand-in for <avr/boot.h> for the host simulator.  The SPM operations
+ *  work on the simulated flash the same way the hardware does.  Each word
+ *  of the page buffer can only be filled once, erase and write take
+ *  their real time and the RWW section reads as 0xFF after either one
+ *  until it is enabled again.  An SPM operation that is started while
+ *  the last one is still going waits for it, so the plain versions
+ *  behave like the _safe ones.
+ */
+
+#ifndef SIM_AVR_BOOT_H
+#define SIM_AVR_BOOT_H
+
+#include <stdint.h>
+
+void sim_page_fill(uint32_t addr, uint16_t data);
+void sim_page_erase(uint32_t addr);
+void sim_page_write(uint32_t addr);
+void sim_rww_enable(void);
+int sim_spm_busy(void);
+int sim_rww_busy(void);
+
+#define boot_page_fill(a, v)      sim_page_fill((uint32_t)(uintptr_t)(a), (v))
+#define boot_page_erase(a)        sim_page_erase((uint32_t)(uintptr_t)(a))
+#define boot_page_write(a)        sim_page_write((uint32_t)(uintptr_t)(a))
+#define boot_rww_enable()         sim_rww_enable()
+#define boot_page_fill_safe(a, v) boot_page_fill(a, v)
+#define boot_page_erase_safe(a)   boot_page_erase(a)
+#define boot_page_write_safe(a)   boot_page_write(a)
+#define boot_rww_enable_safe()    boot_rww_enable()
+#define boot_spm_busy()           sim_spm_busy()
+#define boot_spm_busy_wait()      do {} while(boot_spm_busy())
+#define boot_rww_busy()           sim_rww_busy()
+
+#endif
@@ -0,0 +1,38 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stand-in for <avr/eeprom.h> for the host simulator.
+ */
+
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+int sim_eeprom_ready(void);
+
+#define eeprom_is_ready()  sim_eeprom_ready()
+#define eeprom_busy_wait() do {} while(!eeprom_is_ready())
+
+#endif
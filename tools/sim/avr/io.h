@@ -0,0 +1,153 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stand-in for <avr/io.h> when the bootloader is built for the host
+ *  simulator.  Most registers are just bytes in sim_io[].  The ones that
+ *  have to do something when they are read or written go through a
+ *  function that returns a pointer to the register.
+ */
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+/* The simulator has its own main() so the bootloader's gets renamed */
+#define main bl_main
+
+extern volatile uint8_t sim_io[64];
+volatile uint16_t *sim_tcnt1(void);
+volatile uint8_t *sim_ucsr0a(void);
+volatile uint8_t *sim_ucsr0b(void);
+volatile uint8_t *sim_udr0(void);
+
+/* avr-libc has this in <stdlib.h> but glibc doesn't */
+char *itoa(int value, char *str, int radix);
+
+#if !defined(__AVR_ATmega328P__) && !defined(__AVR_ATmega2561__)
+  #error "Define __AVR_ATmega328P__ or __AVR_ATmega2561__ for the simulator"
+#endif
+
+#ifdef __AVR_ATmega2561__
+  #define FLASHEND 0x3FFFF
+  #define E2END    0xFFF
+  #define RAMEND   0x21FF
+  #define PB0 0
+  #define PB1 1
+  #define PB2 2
+  #define PB3 3
+  #define PB4 4
+  #define PB5 5
+#else
+  #define FLASHEND 0x7FFF
+  #define E2END    0x3FF
+  #define RAMEND   0x8FF
+  #define PB0 0
+  #define PB1 1
+  #define PB2 2
+  #define PB3 3
+  #define PB4 4
+  #define PB5 5
+#endif
+#define RAMSTART 0x100
+#define SPM_PAGESIZE (FLASHEND > 0xFFFF ? 256 : 128)
+
+#define _SFR_IO_ADDR(x) (x)
+#define _BV(bit) (1 << (bit))
+
+/* Port B and D */
+#define PORTB  sim_io[0]
+#define DDRB   sim_io[1]
+#define PINB   sim_io[2]
+#define PORTD  sim_io[3]
+#define DDRD   sim_io[4]
+#define PIND   sim_io[5]
+#define PD2 2
+
+/* SPI */
+#define SPCR   sim_io[6]
+#define SPSR   sim_io[7]
+#define SPDR   sim_io[8]
+#define SPIE 7
+#define SPE  6
+#define MSTR 4
+#define SPR1 1
+#define SPR0 0
+#define SPIF 7
+#define SPI2X 0
+
+/* Timer 0 */
+#define TCCR0A sim_io[9]
+#define TCCR0B sim_io[10]
+#define TCNT0  sim_io[11]
+#define TIFR0  sim_io[12]
+#define TOV0 0
+
+/* Timer 1 */
+#define TCCR1A sim_io[13]
+#define TCCR1B sim_io[14]
+#define TCNT1  (*sim_tcnt1())
+#define TIFR1  sim_io[15]
+#define TOV1 0
+
+/* USART 0 */
+#define UCSR0A (*sim_ucsr0a())
+#define UCSR0B (*sim_ucsr0b())
+#define UCSR0C sim_io[17]
+#define UBRR0H sim_io[18]
+#define UBRR0L sim_io[19]
+#define UDR0   (*sim_udr0())
+#define RXC0  7
+#define TXC0  6
+#define UDRE0 5
+#define U2X0  1
+#define U2X1  1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+/* The only interrupt the bootloader uses.  sim.c calls it when UDRIE0 is
+   set, interrupts are on and the data register is empty. */
+void sim_uart_udre_vect(void);
+#define USART_UDRE_vect  sim_uart_udre_vect
+#define USART0_UDRE_vect sim_uart_udre_vect
+
+/* External interrupts, clock and MCU control */
+#define EICRA  sim_io[20]
+#define EIMSK  sim_io[21]
+#define EIFR   sim_io[22]
+#define INT0  0
+#define INTF0 0
+#define MCUCR  sim_io[23]
+#define MCUSR  sim_io[24]
+#define IVSEL 1
+#define IVCE  0
+#define PORF  0
+#define EXTRF 1
+#define BORF  2
+#define WDRF  3
+#define CLKPR  sim_io[25]
+#define CLKPCE 7
+#define SREG   sim_io[26]
+#define SPL    sim_io[27]
+#define SPH    sim_io[28]
+
+#endif
@@ -0,0 +1,44 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stand-in for <avr/pgmspace.h> for the host simulator.  The bootloader
+ *  reads two kinds of things out of flash.  Addresses of the application
+ *  (small numbers) go to the simulated flash.  PROGMEM tables are just
+ *  ordinary host memory and their addresses are far bigger than any
+ *  flash address, so that is how we tell them apart.
+ */
+
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+
+uint8_t sim_pgm_read_byte(uintptr_t addr);
+
+#define pgm_read_byte_near(a) sim_pgm_read_byte((uintptr_t)(a))
+#define pgm_read_word_near(a) ((uint16_t)(pgm_read_byte_near(a) | pgm_read_byte_near((uintptr_t)(a) + 1) << 8))
+#define pgm_read_byte_far(a)  pgm_read_byte_near(a)
+#define pgm_read_word_far(a)  pgm_read_word_near(a)
+#define pgm_read_dword_far(a) ((uint32_t)pgm_read_word_near(a) | (uint32_t)pgm_read_word_near((uintptr_t)(a) + 2) << 16)
+#define pgm_read_byte(a)      pgm_read_byte_near(a)
+#define pgm_read_word(a)      pgm_read_word_near(a)
+#define pgm_get_far_address(var) ((uintptr_t)&(var))
+
+#endif
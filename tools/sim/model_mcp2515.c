@@ -0,0 +1,293 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Register level model of the MCP2515.  It covers what the bootloader
+ *  uses: the SPI instructions, the operating modes, the two receive
+ *  buffers with their masks, filters and rollover, and the three transmit
+ *  buffers.  Frames that go out take as long as they would on the bus.
+ *  If the bit timing doesn't match the rest of the bus every frame shows
+ *  up as a message error (MERRF) instead.  Only standard frames are
+ *  modelled.
+ */
+
+#include <string.h>
+#include "mcp2515.h"
+#include "sim.h"
+
+static uint8_t reg[128];
+static uint8_t tx_busy[3];
+static uint64_t tx_done[3];
+
+static void
+mcp2515_reset(void)
+{
+    memset(reg, 0, sizeof(reg));
+    memset(tx_busy, 0, sizeof(tx_busy));
+    reg[CAN_CANSTAT] = CAN_MODE_CONFIG;
+    reg[CAN_CANCTRL] = CAN_MODE_CONFIG | 0x07;
+}
+
+static uint8_t
+mode(void)
+{
+    return reg[CAN_CANSTAT] & CAN_MODE_MASK;
+}
+
+/* The bit rate that CNF1-3 give us.  0 if it's nonsense. */
+static uint32_t
+bitrate(void)
+{
+    uint32_t brp, prop, ps1, ps2;
+
+    brp = (reg[CAN_CNF1] & 0x3F) + 1;
+    prop = (reg[CAN_CNF2] & 0x07) + 1;
+    ps1 = ((reg[CAN_CNF2] >> 3) & 0x07) + 1;
+    if(reg[CAN_CNF2] & 0x80) {
+        ps2 = (reg[CAN_CNF3] & 0x07) + 1;
+    } else {
+        ps2 = ps1 > 2 ? ps1 : 2;
+    }
+    if(ps2 < 2) return 0;
+    return MCP2515_OSC / (2 * brp * (1 + prop + ps1 + ps2));
+}
+
+static int
+rate_matches(void)
+{
+    uint32_t rate = bitrate();
+    uint32_t diff = rate > sim_bus->bitrate ? rate - sim_bus->bitrate : sim_bus->bitrate - rate;
+
+    return rate && diff * 100 <= sim_bus->bitrate; /* Within 1% */
+}
+
+static uint16_t
+sid(uint8_t addr)
+{
+    return reg[addr] << 3 | reg[addr + 1] >> 5;
+}
+
+static int
+match(uint16_t id, uint8_t mask, uint8_t filter)
+{
+    return ((id ^ sid(filter)) & sid(mask)) == 0;
+}
+
+static void
+store(uint8_t buff, const struct sim_frame *frame, uint8_t filhit)
+{
+    uint8_t base = buff ? CAN_RXB1CTRL : CAN_RXB0CTRL;
+    uint8_t length = frame->length > 8 ? 8 : frame->length;
+
+    /* FILHIT is one bit in RXB0CTRL, the rest of the low bits are BUKT */
+    reg[base] = (reg[base] & (buff ? 0xF8 : 0xFE)) | filhit;
+    reg[base + 1] = frame->id >> 3;
+    reg[base + 2] = (frame->id & 0x07) << 5;
+    reg[base + 3] = 0;
+    reg[base + 4] = 0;
+    reg[base + 5] = length;
+    memcpy(&reg[base + 6], frame->data, length);
+    reg[CAN_CANINTF] |= 1 << (buff ? CAN_RX1IF : CAN_RX0IF);
+}
+
+/* This is the receive logic from the data sheet.  A frame that passes
+   the buffer 0 filters goes to buffer 0 or, if that is full and BUKT is
+   set, to buffer 1.  Otherwise buffer 1 gets it if it passes those
+   filters. */
+static void
+receive(const struct sim_frame *frame)
+{
+    static const uint8_t filters[6] = {CAN_RXF0SIDH, CAN_RXF1SIDH, CAN_RXF2SIDH,
+                                       CAN_RXF3SIDH, CAN_RXF4SIDH, CAN_RXF5SIDH};
+    int8_t hit0 = -1, hit1 = -1;
+    uint8_t n;
+
+    if((reg[CAN_RXB0CTRL] & 0x60) == 0x60) {
+        hit0 = 0;
+    } else {
+        for(n = 0; n < 2 && hit0 < 0; n++)
+            if(match(frame->id, CAN_RXM0SIDH, filters[n])) hit0 = n;
+    }
+    if((reg[CAN_RXB1CTRL] & 0x60) == 0x60) {
+        hit1 = 2;
+    } else {
+        for(n = 2; n < 6 && hit1 < 0; n++)
+            if(match(frame->id, CAN_RXM1SIDH, filters[n])) hit1 = n;
+    }
+    if(hit0 >= 0) {
+        if(!(reg[CAN_CANINTF] & (1 << CAN_RX0IF))) {
+            store(0, frame, hit0);
+        } else if(reg[CAN_RXB0CTRL] & (1 << CAN_BUKT)) {
+            if(!(reg[CAN_CANINTF] & (1 << CAN_RX1IF))) {
+                store(1, frame, hit0);
+            } else {
+                reg[CAN_EFLG] |= 0x80; /* RX1OVR */
+                reg[CAN_CANINTF] |= 1 << CAN_ERRIF;
+                sim_stats.rx_overflows++;
+            }
+        } else {
+            reg[CAN_EFLG] |= 0x40; /* RX0OVR */
+            reg[CAN_CANINTF] |= 1 << CAN_ERRIF;
+            sim_stats.rx_overflows++;
+        }
+    } else if(hit1 >= 0) {
+        if(!(reg[CAN_CANINTF] & (1 << CAN_RX1IF))) {
+            store(1, frame, hit1);
+        } else {
+            reg[CAN_EFLG] |= 0x80;
+            reg[CAN_CANINTF] |= 1 << CAN_ERRIF;
+            sim_stats.rx_overflows++;
+        }
+    }
+}
+
+static void
+transmit(uint8_t buff)
+{
+    uint8_t base = CAN_TXB0CTRL + 0x10 * buff;
+    struct sim_frame frame;
+
+    frame.id = sid(base + 1);
+    frame.length = reg[base + 5] & 0x0F;
+    if(frame.length > 8) frame.length = 8;
+    frame.flags = 0;
+    memcpy(frame.data, &reg[base + 6], frame.length);
+    if(mode() == CAN_MODE_LOOPBACK) {
+        tx_done[buff] = sim_now();
+        receive(&frame);
+    } else {
+        tx_done[buff] = sim_now() + sim_frame_time(&frame, bitrate(), 0);
+        sim_bus->send(&frame);
+    }
+    tx_busy[buff] = 1;
+}
+
+/* Brings everything up to date.  This gets called before every SPI
+   transfer so the bootloader sees the chip the way it would be at that
+   moment. */
+static void
+update(void)
+{
+    struct sim_frame frame;
+    uint8_t n, base;
+
+    for(n = 0; n < 3; n++) {
+        base = CAN_TXB0CTRL + 0x10 * n;
+        if(tx_busy[n] && sim_now() >= tx_done[n]) {
+            tx_busy[n] = 0;
+            reg[base] &= ~(1 << CAN_TXREQ);
+            reg[CAN_CANINTF] |= 1 << (CAN_TX0IF + n);
+        }
+        if(!tx_busy[n] && (reg[base] & (1 << CAN_TXREQ)) &&
+           (mode() == CAN_MODE_NORMAL || mode() == CAN_MODE_LOOPBACK)) {
+            if(mode() == CAN_MODE_NORMAL && !rate_matches()) {
+                /* Nobody can ACK it.  It just keeps trying. */
+                reg[CAN_CANINTF] |= 1 << CAN_MERRF;
+                continue;
+            }
+            transmit(n);
+        }
+    }
+    while(sim_bus->recv(&frame)) {
+        if(mode() == CAN_MODE_CONFIG || mode() == CAN_MODE_SLEEP ||
+           mode() == CAN_MODE_LOOPBACK) continue;
+        if((frame.flags & SIM_FD) || !rate_matches()) {
+            reg[CAN_CANINTF] |= 1 << CAN_MERRF;
+            continue;
+        }
+        receive(&frame);
+    }
+}
+
+static uint8_t
+read(uint8_t addr)
+{
+    addr &= 0x7F;
+    if((addr & 0x0F) == 0x0E) return reg[CAN_CANSTAT];
+    if((addr & 0x0F) == 0x0F) return reg[CAN_CANCTRL];
+    return reg[addr];
+}
+
+static void
+write(uint8_t addr, uint8_t value)
+{
+    addr &= 0x7F;
+    if((addr & 0x0F) == 0x0E) return; /* CANSTAT is read only */
+    if((addr & 0x0F) == 0x0F) {
+        reg[CAN_CANCTRL] = value;
+        reg[CAN_CANSTAT] = (reg[CAN_CANSTAT] & ~CAN_MODE_MASK) | (value & CAN_MODE_MASK);
+        return;
+    }
+    /* The filters, masks and CNF1-3 can only be changed in configuration mode */
+    if(addr < CAN_CANINTE && (addr & 0x0F) < 0x0C && mode() != CAN_MODE_CONFIG) return;
+    if(addr == CAN_EFLG) value &= reg[CAN_EFLG] | 0x3F;
+    if(addr == CAN_RXB0CTRL || addr == CAN_RXB1CTRL) value = (value & 0x6C) | (reg[addr] & 0x03);
+    reg[addr] = value;
+}
+
+static void
+mcp2515_spi(const uint8_t *write_buff, uint8_t *read_buff, uint8_t size)
+{
+    static const uint8_t rx_start[4] = {CAN_RXB0SIDH, CAN_RXB0D0, CAN_RXB1SIDH, CAN_RXB1D0};
+    static const uint8_t tx_start[6] = {0x31, 0x36, 0x41, 0x46, 0x51, 0x56};
+    uint8_t wb[256], cmd, addr, n, status;
+
+    if(size == 0) return;
+    memcpy(wb, write_buff, size);
+    memset(read_buff, 0, size);
+    update();
+    cmd = wb[0];
+    if(cmd == CAN_RESET) {
+        mcp2515_reset();
+    } else if(cmd == CAN_READ) {
+        addr = wb[1];
+        for(n = 2; n < size; n++) read_buff[n] = read(addr++);
+    } else if(cmd == CAN_WRITE) {
+        addr = wb[1];
+        for(n = 2; n < size; n++) write(addr++, wb[n]);
+    } else if(cmd == CAN_BIT_MODIFY && size >= 4) {
+        write(wb[1], (read(wb[1]) & ~wb[2]) | (wb[3] & wb[2]));
+    } else if((cmd & 0xF9) == 0x90) { /* READ RX BUFFER */
+        addr = rx_start[(cmd >> 1) & 0x03];
+        for(n = 1; n < size; n++) read_buff[n] = read(addr++);
+        reg[CAN_CANINTF] &= ~(1 << (cmd & 0x04 ? CAN_RX1IF : CAN_RX0IF));
+    } else if((cmd & 0xF8) == CAN_LOAD_TX_BUFFER && (cmd & 0x07) < 6) {
+        addr = tx_start[cmd & 0x07];
+        for(n = 1; n < size; n++) write(addr++, wb[n]);
+    } else if((cmd & 0xF0) == CAN_RTS) {
+        for(n = 0; n < 3; n++)
+            if(cmd & (1 << n)) reg[CAN_TXB0CTRL + 0x10 * n] |= 1 << CAN_TXREQ;
+    } else if(cmd == CAN_READ_STATUS) {
+        status = (reg[CAN_CANINTF] & 0x03) |
+                 (reg[CAN_TXB0CTRL] & (1 << CAN_TXREQ) ? 0x04 : 0) |
+                 (reg[CAN_CANINTF] & (1 << CAN_TX0IF) ? 0x08 : 0) |
+                 (reg[0x40] & (1 << CAN_TXREQ) ? 0x10 : 0) |
+                 (reg[CAN_CANINTF] & (1 << CAN_TX1IF) ? 0x20 : 0) |
+                 (reg[0x50] & (1 << CAN_TXREQ) ? 0x40 : 0) |
+                 (reg[CAN_CANINTF] & (1 << CAN_TX2IF) ? 0x80 : 0);
+        for(n = 1; n < size; n++) read_buff[n] = status;
+    } else if(cmd == CAN_RX_STATUS) {
+        status = (reg[CAN_CANINTF] & 0x03) << 6;
+        for(n = 1; n < size; n++) read_buff[n] = status;
+    }
+    update(); /* A transmit request goes out right away */
+}
+
+const struct sim_chip sim_mcp2515 = {
+    "MCP2515",
+    mcp2515_reset,
+    mcp2515_spi
+};
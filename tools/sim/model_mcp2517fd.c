@@ -0,0 +1,384 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Register level model of the MCP2517FD.  The registers and message RAM
+ *  are one byte array the way the chip's address space is.  The FIFOs get
+ *  their RAM when the chip leaves configuration mode, in the same order
+ *  as the real chip hands it out, so the user addresses that the
+ *  bootloader reads back are the real ones.  The filter and mask
+ *  registers, the FIFO status and user address registers and the
+ *  interrupt flags work on standard frames.  A frame at the wrong nominal
+ *  or data bit rate, or an FD frame in CAN 2.0 mode, sets IVMIF.
+ */
+
+#include <string.h>
+#include "mcp2517fd.h"
+#include "sim.h"
+
+#define FIFOS 32
+#define FD_C1TXQCON 0x050 /* FIFO 0 is the transmit queue */
+#define FD_C1TEFCON 0x040
+#define FD_C1FIFOCI(m) (0x055 + 12 * (m)) /* Byte 1 of FIFOSTA */
+
+static uint8_t mem[0x1000];
+
+static struct fifo {
+    uint16_t base;    /* RAM address of the first object */
+    uint8_t depth;
+    uint8_t payload;
+    uint8_t object;   /* Size of an object in bytes */
+    uint8_t head;     /* The next one for the chip (TX) or the bootloader (RX) */
+    uint8_t count;
+    uint8_t tx;
+} fifo[FIFOS];
+static uint64_t tx_done;
+static int8_t tx_fifo = -1; /* FIFO with a frame on the bus */
+
+static const uint8_t payload_size[8] = {8, 12, 16, 20, 24, 32, 48, 64};
+static const uint8_t dlc_length[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+static uint8_t
+mode(void)
+{
+    return (mem[FD_C1CON + FD_OPMOD_BYTE] >> 5) & CAN_MODE_MASK;
+}
+
+static void
+set32(uint16_t addr, uint32_t value)
+{
+    mem[addr] = value;
+    mem[addr + 1] = value >> 8;
+    mem[addr + 2] = value >> 16;
+    mem[addr + 3] = value >> 24;
+}
+
+static void
+mcp2517fd_reset(void)
+{
+    uint8_t n;
+
+    memset(mem, 0, sizeof(mem));
+    memset(fifo, 0, sizeof(fifo));
+    tx_fifo = -1;
+    set32(FD_C1CON, 0x04980760);
+    set32(FD_C1NBTCFG, 0x003E0F0F);
+    set32(FD_C1DBTCFG, 0x000E0303);
+    set32(FD_C1TDC, 0x00021000);
+    set32(FD_C1TEFCON, 0x00000400);
+    set32(FD_C1TXQCON, 0x00600400);
+    for(n = 1; n < FIFOS; n++) set32(FD_C1FIFOCON(n), 0x00600000);
+    mem[FD_OSC + 1] |= (1 << FD_OSCRDY);
+}
+
+/* Hands out the RAM.  TEF first, then TXQ and then the FIFOs in order. */
+static void
+allocate(void)
+{
+    uint16_t addr = 0;
+    uint8_t n, con;
+
+    if(mem[FD_C1CON + 2] & (1 << FD_STEF)) {
+        addr += 8 * ((mem[FD_C1TEFCON + 3] & 0x1F) + 1);
+    }
+    for(n = 0; n < FIFOS; n++) {
+        con = mem[FD_C1FIFOCON(n) + 3];
+        fifo[n].head = fifo[n].count = 0;
+        fifo[n].depth = 0;
+        if(n == 0 && !(mem[FD_C1CON + 2] & (1 << FD_TXQEN))) continue;
+        fifo[n].tx = n == 0 || (mem[FD_C1FIFOCON(n)] & (1 << FD_TXEN));
+        fifo[n].depth = (con & 0x1F) + 1;
+        fifo[n].payload = payload_size[con >> 5];
+        fifo[n].object = 8 + fifo[n].payload;
+        if(!fifo[n].tx && (mem[FD_C1FIFOCON(n)] & 0x20)) fifo[n].object += 4; /* RXTSEN */
+        fifo[n].base = addr;
+        addr += fifo[n].depth * fifo[n].object;
+    }
+}
+
+/* Where the bootloader reads or writes next */
+static uint16_t
+user_address(uint8_t n)
+{
+    struct fifo *f = &fifo[n];
+
+    if(f->depth == 0) return 0;
+    if(f->tx) return f->base + ((f->head + f->count) % f->depth) * f->object;
+    return f->base + f->head * f->object;
+}
+
+/* Refreshes the registers that are really status */
+static void
+status(void)
+{
+    uint8_t n, flags, rx = 0, tx = 0;
+    struct fifo *f;
+
+    for(n = 0; n < FIFOS; n++) {
+        f = &fifo[n];
+        flags = mem[FD_C1FIFOSTA(n)] & 0x08; /* RXOVIF is sticky */
+        if(f->depth) {
+            if(f->tx) {
+                if(f->count < f->depth) flags |= 0x01;
+                if(f->count <= f->depth / 2) flags |= 0x02;
+                if(f->count == 0) flags |= 0x04;
+            } else {
+                if(f->count) flags |= 0x01;
+                if(f->count >= (f->depth + 1) / 2) flags |= 0x02;
+                if(f->count == f->depth) flags |= 0x04;
+            }
+        }
+        mem[FD_C1FIFOSTA(n)] = flags;
+        mem[FD_C1FIFOCI(n)] = f->tx ? (f->head + f->count) % (f->depth ? f->depth : 1) : f->head;
+        set32(FD_C1FIFOUA(n), user_address(n));
+        if(f->depth && (flags & mem[FD_C1FIFOCON(n)] & 0x07)) {
+            if(f->tx) tx = 1;
+            else rx = 1;
+        }
+    }
+    mem[FD_C1INT] = (mem[FD_C1INT] & ~((1 << FD_TXIF) | (1 << FD_RXIF))) |
+                    (tx << FD_TXIF) | (rx << FD_RXIF);
+}
+
+static void
+set_mode(uint8_t request)
+{
+    uint8_t old = mode();
+
+    request &= CAN_MODE_MASK;
+    if(request == 5 || request == 7) return; /* Restricted and abort aren't modelled */
+    if(old == CAN_MODE_CONFIG && request != CAN_MODE_CONFIG) {
+        allocate();
+    } else if(request == CAN_MODE_CONFIG) {
+        memset(fifo, 0, sizeof(fifo));
+        tx_fifo = -1;
+    }
+    mem[FD_C1CON + FD_OPMOD_BYTE] = (mem[FD_C1CON + FD_OPMOD_BYTE] & 0x1F) | (request << 5);
+}
+
+static uint32_t
+rate(uint16_t reg)
+{
+    uint32_t brp = mem[reg + 3] + 1;
+    uint32_t tq = 1 + (mem[reg + 2] + 1) + ((mem[reg + 1] & 0x7F) + 1);
+
+    return MCP2517FD_OSC / (brp * tq);
+}
+
+static int
+close_to(uint32_t a, uint32_t b)
+{
+    uint32_t diff = a > b ? a - b : b - a;
+
+    return b && diff * 100 <= b;
+}
+
+static uint16_t
+sid(uint16_t addr)
+{
+    return mem[addr] | (mem[addr + 1] & 0x07) << 8;
+}
+
+static void
+receive(const struct sim_frame *frame)
+{
+    uint8_t n, dlc, length;
+    uint16_t addr;
+    struct fifo *f;
+
+    for(n = 0; n < 32; n++) {
+        if(!(mem[FD_C1FLTCON(n)] & (1 << FD_FLTEN))) continue;
+        if((frame->id ^ sid(FD_C1FLTOBJ(n))) & sid(FD_C1MASK(n))) continue;
+        if((mem[FD_C1MASK(n) + 3] & (1 << FD_MIDE)) && (mem[FD_C1FLTOBJ(n) + 3] & 0x40)) continue;
+        f = &fifo[mem[FD_C1FLTCON(n)] & 0x1F];
+        if(f->depth == 0 || f->tx) return;
+        if(f->count == f->depth) {
+            mem[FD_C1FIFOSTA(f - fifo)] |= 0x08;
+            mem[FD_C1INT + 1] |= 0x08; /* RXOVIF */
+            sim_stats.rx_overflows++;
+            return;
+        }
+        for(dlc = 0; dlc < 15 && dlc_length[dlc] < frame->length; dlc++);
+        length = dlc_length[dlc] < f->payload ? dlc_length[dlc] : f->payload;
+        addr = FD_RAM + f->base + ((f->head + f->count) % f->depth) * f->object;
+        set32(addr, frame->id);
+        set32(addr + 4, dlc | (frame->flags & SIM_FD ? 1 << FD_OBJ_FDF : 0) |
+                        (frame->flags & SIM_BRS ? 1 << FD_OBJ_BRS : 0) | (uint32_t)n << 11);
+        if(f->object > 8 + f->payload) {
+            set32(addr + 8, (uint32_t)sim_now());
+            addr += 4;
+        }
+        memset(&mem[addr + 8], 0, length);
+        memcpy(&mem[addr + 8], frame->data, frame->length < length ? frame->length : length);
+        f->count++;
+        return;
+    }
+}
+
+static void
+transmit(uint8_t n)
+{
+    struct fifo *f = &fifo[n];
+    uint16_t addr = FD_RAM + f->base + f->head * f->object;
+    struct sim_frame frame;
+
+    frame.id = sid(addr);
+    frame.flags = (mem[addr + 4] & (1 << FD_OBJ_FDF)) ? SIM_FD : 0;
+    if(mem[addr + 4] & (1 << FD_OBJ_BRS)) frame.flags |= SIM_BRS;
+    frame.length = dlc_length[mem[addr + 4] & 0x0F];
+    if(!(frame.flags & SIM_FD) && frame.length > 8) frame.length = 8;
+    if(frame.length > f->payload) frame.length = f->payload;
+    memcpy(frame.data, &mem[addr + 8], frame.length);
+    if(mode() == CAN_MODE_LOOPBACK) {
+        tx_done = sim_now();
+        receive(&frame);
+    } else {
+        tx_done = sim_now() + sim_frame_time(&frame, rate(FD_C1NBTCFG), rate(FD_C1DBTCFG));
+        sim_bus->send(&frame);
+    }
+    tx_fifo = n;
+}
+
+/* Lowest number wins when they have the same priority, which is what
+   the chip does. */
+static int8_t
+next_tx(void)
+{
+    int8_t best = -1;
+    uint8_t n;
+
+    for(n = 0; n < FIFOS; n++) {
+        if(!fifo[n].tx || !fifo[n].count || !(mem[FD_C1FIFOCON(n) + 1] & (1 << FD_TXREQ))) continue;
+        if(best < 0 || (mem[FD_C1FIFOCON(n) + 2] & 0x1F) > (mem[FD_C1FIFOCON(best) + 2] & 0x1F))
+            best = n;
+    }
+    return best;
+}
+
+static void
+update(void)
+{
+    struct sim_frame frame;
+    int8_t n;
+    uint8_t m = mode();
+
+    if(tx_fifo >= 0 && sim_now() >= tx_done) {
+        struct fifo *f = &fifo[tx_fifo];
+        f->head = (f->head + 1) % f->depth;
+        f->count--;
+        if(f->count == 0) mem[FD_C1FIFOCON(tx_fifo) + 1] &= ~(1 << FD_TXREQ);
+        tx_fifo = -1;
+    }
+    if(tx_fifo < 0 && (m == CAN_MODE_NORMAL || m == CAN_MODE_CLASSIC || m == CAN_MODE_LOOPBACK)) {
+        n = next_tx();
+        if(n >= 0) {
+            if(m != CAN_MODE_LOOPBACK && !close_to(rate(FD_C1NBTCFG), sim_bus->bitrate)) {
+                mem[FD_C1INT + 1] |= (1 << FD_CERRIF);
+            } else {
+                transmit(n);
+            }
+        }
+    }
+    while(sim_bus->recv(&frame)) {
+        if(m == CAN_MODE_CONFIG || m == CAN_MODE_SLEEP || m == CAN_MODE_LOOPBACK) continue;
+        if(!close_to(rate(FD_C1NBTCFG), sim_bus->bitrate) ||
+           ((frame.flags & SIM_FD) && m == CAN_MODE_CLASSIC) ||
+           ((frame.flags & SIM_BRS) && !close_to(rate(FD_C1DBTCFG), sim_bus->data_bitrate))) {
+            mem[FD_C1INT + 1] |= (1 << FD_IVMIF);
+            continue;
+        }
+        receive(&frame);
+    }
+    status();
+}
+
+static void
+write(uint16_t addr, uint8_t value)
+{
+    uint8_t n;
+
+    if(addr == FD_C1CON + FD_REQOP_BYTE) {
+        mem[addr] = (mem[addr] & 0xF8) | (value & 0x07);
+        set_mode(value);
+        return;
+    }
+    if(addr == FD_C1CON + FD_OPMOD_BYTE) {
+        mem[addr] = (value & 0x1F) | (mem[addr] & 0xE0);
+        return;
+    }
+    if(addr == FD_C1INT || addr == FD_C1INT + 1) { /* Flags can only be cleared */
+        mem[addr] &= value;
+        return;
+    }
+    if(addr >= FD_C1FIFOCON(0) && addr < FD_C1FIFOCON(FIFOS)) {
+        n = (addr - FD_C1FIFOCON(0)) / 12;
+        switch((addr - FD_C1FIFOCON(0)) % 12) {
+        case 1: /* UINC, TXREQ and FRESET */
+            if(value & (1 << FD_FRESET)) {
+                fifo[n].head = fifo[n].count = 0;
+                mem[FD_C1FIFOSTA(n)] &= ~0x08;
+            }
+            if((value & (1 << FD_UINC)) && fifo[n].depth) {
+                if(fifo[n].tx) {
+                    if(fifo[n].count < fifo[n].depth) fifo[n].count++;
+                } else if(fifo[n].count) {
+                    fifo[n].head = (fifo[n].head + 1) % fifo[n].depth;
+                    fifo[n].count--;
+                }
+            }
+            mem[addr] = (mem[addr] & ~(1 << FD_TXREQ)) | (value & (1 << FD_TXREQ));
+            return;
+        case 0: case 2: case 3:
+            mem[addr] = value;
+            return;
+        case 4: /* FIFOSTA, only RXOVIF can be cleared */
+            mem[addr] &= value | ~0x08;
+            return;
+        default: /* Read only */
+            return;
+        }
+    }
+    if(addr >= 0x1000) return;
+    mem[addr] = value;
+}
+
+static void
+mcp2517fd_spi(const uint8_t *write_buff, uint8_t *read_buff, uint8_t size)
+{
+    uint8_t wb[256], cmd, n;
+    uint16_t addr;
+
+    if(size == 0) return;
+    memcpy(wb, write_buff, size);
+    memset(read_buff, 0, size);
+    update();
+    cmd = wb[0] & 0xF0;
+    addr = (wb[0] & 0x0F) << 8 | (size > 1 ? wb[1] : 0);
+    if(cmd == FD_RESET) {
+        mcp2517fd_reset();
+    } else if(cmd == FD_READ) {
+        for(n = 2; n < size; n++) read_buff[n] = mem[addr++ & 0xFFF];
+    } else if(cmd == FD_WRITE) {
+        for(n = 2; n < size; n++) write(addr++ & 0xFFF, wb[n]);
+    }
+    update();
+}
+
+const struct sim_chip sim_mcp2517fd = {
+    "MCP2517FD",
+    mcp2517fd_reset,
+    mcp2517fd_spi
+};
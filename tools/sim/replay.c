@@ -0,0 +1,654 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Replays firmware updates against the bootloader in virtual time and
+ *  reports how long things took.  Nothing here waits on the wall clock so
+ *  a run takes as long as the host needs to execute it, and the same
+ *  options and seed give the same numbers every time.
+ *
+ *  The update comes from a candump log of a real one (candump -l, or the
+ *  normal candump output with -t a) or from a firmware file with -s.  In
+ *  a log the first firmware request picks the node and the channel, and
+ *  the image is put back together from what went out on that channel.
+ *  Everything else in the log is background traffic and goes back on the
+ *  bus at the time it was recorded.  On top of that -B adds random
+ *  background traffic, -L loses frames and -R swaps pairs of frames that
+ *  go to the node.
+ *
+ *  The host side works like canfix-upload: up to -w frames waiting for
+ *  an answer and a page that stops getting answers is started over.
+ *  All of the frames share one bus, one at a time.
+ *
+ *  Build it from the top of the repository with
+ *
+ *    gcc -O2 -Wall -std=gnu99 -funsigned-char -D__AVR_ATmega328P__ \
+ *        -Itools/sim -Itools -IAVRBootloader -o canfix-replay \
+ *        AVRBootloader/main.c AVRBootloader/log.c AVRBootloader/can.c \
+ *        AVRBootloader/can_mcp2517fd.c \
+ *        tools/sim/sim.c tools/sim/model_mcp2515.c tools/sim/model_mcp2517fd.c \
+ *        tools/sim/replay.c tools/fwimage.c
+ *
+ *  Add -DCAN_MCP2517FD to build it with the MCP2517FD driver and model.
+ *  Then for example
+ *
+ *    ./canfix-replay -N 20 -B 30 -L 0.5 update.log
+ *    ./canfix-replay -N 20 -B 50 -s firmware.hex
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include "sim.h"
+#include "bootloader.h"
+#include "fix.h"
+#include "fwimage.h"
+
+#define MS 1000000ULL /* nS */
+
+#define ACK_TIMEOUT   (1500 * MS) /* The same as canfix-upload */
+#define MAX_RETRIES   3
+#define CONNECT_RETRY (50 * MS)
+#define RUN_LIMIT     (300000 * MS) /* A run that takes longer than this failed */
+#define BUS_QUEUE     256
+
+static const uint32_t rates[] = {125000, 250000, 500000, 1000000, 50000, 100000, 800000};
+
+/* A frame from the log or one that we made up */
+struct bg_frame {
+    uint64_t t;        /* nS after the firmware request */
+    struct sim_frame frame;
+};
+
+/* A frame on the bus.  It gets to everybody when it ends. */
+struct bus_frame {
+    uint64_t end;
+    uint8_t to_node;   /* 0 if the node sent it */
+    uint8_t lost;
+    struct sim_frame frame;
+};
+
+/* A set of times for the histograms */
+struct samples {
+    const char *name;
+    uint64_t *t;
+    uint32_t n, size;
+};
+
+static struct samples cmd_times = {"Command answers"};
+static struct samples page_times = {"Page commits"};
+static struct samples session_times = {"Whole sessions"};
+
+/* How a run ended */
+#define RUN_GOOD     1
+#define RUN_REFUSED  2 /* The node said no to the firmware request */
+#define RUN_GAVE_UP  3 /* A page didn't get answers MAX_RETRIES times */
+#define RUN_BAD      4 /* The flash doesn't match the image */
+#define RUN_APP      5 /* The node started the application instead */
+#define RUN_TOO_LONG 6
+static const char *run_results[] = {NULL, "good", "refused", "gave up", "wrong flash",
+                                    "started the application", "took too long"};
+
+/* What the runs add up to */
+static struct {
+    uint32_t result[7];
+    uint32_t sent, answers, background;
+    uint32_t lost, reordered, page_retries;
+    uint32_t rx_overflows;
+} total;
+
+static uint8_t node = 0x22, host = 0x01, channel;
+static int node_set, fd, window = 2, quiet;
+static double bg_load, loss, reorder; /* Percent */
+static struct sim_bus bus;
+static uint8_t *image, *flash, *eeprom;
+static uint32_t image_size;
+static struct op *ops;
+static int count;
+static struct bg_frame *bg;
+static int bg_count;
+
+/* The state of one run */
+static struct {
+    uint64_t start, connect_next, bus_free, hold, bg_next;
+    int connected, next, oldest, retries, bg;
+    struct bus_frame queue[BUS_QUEUE];
+    int head, tail;
+} run;
+static jmp_buf run_end;
+
+static double
+chance(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+static void
+add_sample(struct samples *s, uint64_t t)
+{
+    if(s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        s->t = realloc(s->t, s->size * sizeof(*s->t));
+        if(s->t == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->t[s->n++] = t;
+}
+
+/* Puts a frame on the bus after whatever is already on it.  Frames are
+   lost on the way with the -L chance.  A lost frame still takes up the
+   bus. */
+static void
+bus_put(const struct sim_frame *frame, int to_node)
+{
+    struct bus_frame *b;
+    uint64_t start = sim_now() > run.bus_free ? sim_now() : run.bus_free;
+
+    if((run.tail + 1) % BUS_QUEUE == run.head) {
+        fprintf(stderr, "replay: the bus queue is full\n");
+        exit(1);
+    }
+    b = &run.queue[run.tail];
+    run.tail = (run.tail + 1) % BUS_QUEUE;
+    b->frame = *frame;
+    b->to_node = to_node;
+    b->end = run.bus_free = start + sim_frame_time(frame, bus.bitrate, bus.data_bitrate);
+    b->lost = loss > 0 && chance() * 100 < loss;
+    if(b->lost) total.lost++;
+}
+
+static void
+send_op(int k)
+{
+    struct sim_frame frame;
+
+    frame.id = FIX_2WAY_CHANNEL + channel * 2;
+    frame.length = ops[k].length;
+    frame.flags = ops[k].fd ? SIM_FD | SIM_BRS : 0;
+    memcpy(frame.data, ops[k].data, ops[k].length);
+    ops[k].sent = sim_now();
+    bus_put(&frame, 1);
+    total.sent++;
+}
+
+static void
+end_run(int result)
+{
+    longjmp(run_end, result);
+}
+
+/* Something got lost.  Starts the page over once the node has given up
+   on it, the same as canfix-upload. */
+static void
+restart_page(void)
+{
+    int first;
+
+    if(++run.retries > MAX_RETRIES) end_run(RUN_GAVE_UP);
+    total.page_retries++;
+    for(first = run.oldest; first > 0 && ops[first - 1].page == ops[run.oldest].page; first--);
+    run.next = run.oldest = first;
+    run.hold = sim_now() + ACK_TIMEOUT;
+}
+
+/* An answer from the node got to us */
+static void
+host_receive(const struct sim_frame *frame)
+{
+    struct canfd_frame cf;
+    int i, first;
+
+    total.answers++;
+    if(!run.connected) {
+        if(frame->id == FIX_NODE_SPECIFIC + node && frame->length >= 3 &&
+           frame->data[0] == FIX_FIRMWARE && frame->data[1] == host) {
+            if(frame->data[2] != 0x00) end_run(RUN_REFUSED);
+            run.connected = 1;
+        }
+        return;
+    }
+    if(frame->id != FIX_2WAY_CHANNEL + channel * 2 + 1 || sim_now() < run.hold) return;
+    memset(&cf, 0, sizeof(cf));
+    cf.len = frame->length;
+    memcpy(cf.data, frame->data, frame->length);
+    for(i = run.oldest; i < run.next && !fw_ack_matches(&ops[i], &cf); i++);
+    if(i == run.next) return;
+    if(i > run.oldest) {
+        restart_page();
+        return;
+    }
+    run.oldest++;
+    /* The buffer data answers are two bytes, everything else is a command */
+    if(ops[i].ack_length > 2) add_sample(&cmd_times, sim_now() - (uint64_t)ops[i].sent);
+    if(ops[i].page >= 0 && ops[i + 1].page != ops[i].page) {
+        run.retries = 0;
+        for(first = i; first > 0 && ops[first - 1].page == ops[i].page; first--);
+        add_sample(&page_times, sim_now() - (uint64_t)ops[first].sent);
+    }
+}
+
+/* Everything that the host and the rest of the bus do up to now */
+static void
+host_step(void)
+{
+    struct sim_frame frame;
+    uint64_t now = sim_now(), gap;
+
+    if(now - run.start > RUN_LIMIT) end_run(RUN_TOO_LONG);
+    /* Background traffic from the log and made up */
+    while(run.bg < bg_count && run.start + bg[run.bg].t <= now) {
+        bus_put(&bg[run.bg++].frame, 1);
+        total.background++;
+    }
+    if(bg_load > 0 && run.bg_next <= now) {
+        frame.id = 0x100 + rand() % 0x500; /* Below the node specific messages */
+        frame.length = 1 + rand() % 8;
+        frame.flags = 0;
+        memset(frame.data, rand(), frame.length);
+        bus_put(&frame, 1);
+        total.background++;
+        gap = sim_frame_time(&frame, bus.bitrate, bus.data_bitrate) * 100 / bg_load;
+        run.bg_next = now + gap / 2 + rand() % (gap + 1);
+    }
+
+    if(!run.connected) {
+        if(now >= run.connect_next) {
+            frame.id = FIX_NODE_SPECIFIC + host;
+            frame.length = 5;
+            frame.flags = 0;
+            frame.data[0] = FIX_FIRMWARE;
+            frame.data[1] = node;
+            frame.data[2] = BL_VERIFY_LSB;
+            frame.data[3] = BL_VERIFY_MSB;
+            frame.data[4] = channel;
+            bus_put(&frame, 1);
+            total.sent++;
+            run.connect_next = now + CONNECT_RETRY;
+        }
+        return;
+    }
+    if(now < run.hold) return;
+    if(run.next > run.oldest && now > (uint64_t)ops[run.oldest].sent + ACK_TIMEOUT) {
+        restart_page();
+        return;
+    }
+    while(run.next < count && run.next - run.oldest < window &&
+          !(ops[run.next].wait && run.next > run.oldest)) {
+        if(reorder > 0 && run.next + 1 < count && run.next + 1 - run.oldest < window &&
+           !ops[run.next + 1].wait && chance() * 100 < reorder) {
+            send_op(run.next + 1);
+            send_op(run.next);
+            run.next += 2;
+            total.reordered++;
+            continue;
+        }
+        send_op(run.next++);
+    }
+}
+
+/* The node's controller asks for the next frame.  Whatever the node sent
+   that has finished by now gets to the host first. */
+static int
+bus_recv(struct sim_frame *frame)
+{
+    struct bus_frame *b;
+
+    host_step();
+    while(run.head != run.tail && run.queue[run.head].end <= sim_now()) {
+        b = &run.queue[run.head];
+        run.head = (run.head + 1) % BUS_QUEUE;
+        if(b->lost) continue;
+        if(b->to_node) {
+            *frame = b->frame;
+            return 1;
+        }
+        host_receive(&b->frame);
+    }
+    return 0;
+}
+
+static void
+bus_send(const struct sim_frame *frame)
+{
+    bus_put(frame, 0);
+}
+
+/* The node resets after it answers the Complete command.  The answer
+   is still on the bus.  If it gets lost the update still worked. */
+static void
+node_reset(void)
+{
+    struct bus_frame *b;
+
+    for(; run.head != run.tail; run.head = (run.head + 1) % BUS_QUEUE) {
+        b = &run.queue[run.head];
+        if(!b->to_node && !b->lost) host_receive(&b->frame);
+    }
+    end_run(memcmp(flash, image, image_size) == 0 ? RUN_GOOD : RUN_BAD);
+}
+
+static void
+node_start_app(void)
+{
+    end_run(RUN_APP);
+}
+
+/* One whole update from a blank part */
+static void
+run_once(const struct sim_chip *chip, uint8_t rate)
+{
+    uint32_t overflows = sim_stats.rx_overflows;
+    int result;
+
+    memset(flash, 0xFF, sim_flash_size);
+    memset(eeprom, 0xFF, sim_eeprom_size);
+    eeprom[0] = rate;
+    eeprom[1] = node;
+    memset(&run, 0, sizeof(run));
+    sim_init(chip, &bus, flash, eeprom);
+    run.start = run.bus_free = run.connect_next = run.bg_next = sim_now();
+    result = setjmp(run_end);
+    if(result == 0) {
+        bl_main();
+        result = RUN_APP;
+    }
+    total.result[result]++;
+    if(result == RUN_GOOD) add_sample(&session_times, sim_now() - run.start);
+    total.rx_overflows += sim_stats.rx_overflows - overflows;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Prints a histogram with buckets that double from one to the next */
+static void
+print_samples(struct samples *s)
+{
+    uint32_t bucket[40], i, most = 0;
+    int b, lo = 40, hi = 0;
+    uint64_t sum = 0;
+
+    if(s->n == 0) {
+        printf("%s: none\n", s->name);
+        return;
+    }
+    qsort(s->t, s->n, sizeof(*s->t), compare);
+    memset(bucket, 0, sizeof(bucket));
+    for(i = 0; i < s->n; i++) {
+        sum += s->t[i];
+        for(b = 0; b < 39 && s->t[i] / 1000 >= (2ULL << b); b++);
+        bucket[b]++;
+        if(b < lo) lo = b;
+        if(b > hi) hi = b;
+        if(bucket[b] > most) most = bucket[b];
+    }
+    printf("%s: %u, mean %.2f mS, 50%% %.2f mS, 99%% %.2f mS, max %.2f mS\n", s->name, s->n,
+           sum / 1e6 / s->n, s->t[s->n / 2] / 1e6, s->t[s->n * 99 / 100] / 1e6,
+           s->t[s->n - 1] / 1e6);
+    if(quiet) return;
+    for(b = lo; b <= hi; b++) {
+        printf("  %8llu - %8llu uS %7u  ", b ? 1ULL << b : 0ULL, 2ULL << b, bucket[b]);
+        for(i = 0; i < (bucket[b] * 40 + most - 1) / most; i++) putchar('#');
+        putchar('\n');
+    }
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Reads one line of candump output.  Returns 1 with the frame and the
+   time in seconds, or -1 if there is no time on the line, and 0 for a
+   line that isn't a frame. */
+static int
+parse_line(char *line, struct sim_frame *frame, double *t)
+{
+    char *tok, *p;
+    unsigned v;
+    int n;
+
+    *t = -1;
+    tok = strtok(line, " \t\r\n");
+    if(tok && tok[0] == '(') {
+        *t = strtod(tok + 1, NULL);
+        tok = strtok(NULL, " \t\r\n");
+    }
+    if(tok == NULL) return 0;
+    tok = strtok(NULL, " \t\r\n"); /* After the interface */
+    if(tok == NULL) return 0;
+    memset(frame, 0, sizeof(*frame));
+    p = strchr(tok, '#');
+    if(p) { /* 123#0102 or 123##1010203 */
+        *p++ = '\0';
+        if(*p == '#') {
+            frame->flags = SIM_FD | (strtoul(p + 1, NULL, 16) & 0x01 ? SIM_BRS : 0);
+            p += 2;
+        } else if(*p == 'R') {
+            return 0;
+        }
+        for(n = 0; n < 64 && sscanf(p, "%2x", &v) == 1; n++, p += 2) frame->data[n] = v;
+        frame->length = n;
+    } else { /* 123   [2]  01 02 */
+        p = strtok(NULL, " \t\r\n");
+        if(p == NULL || sscanf(p, "[%d]", &n) != 1 || n > 64) return 0;
+        frame->length = n;
+        if(n > 8) frame->flags = SIM_FD | SIM_BRS;
+        for(n = 0; n < frame->length; n++) {
+            p = strtok(NULL, " \t\r\n");
+            if(p == NULL || sscanf(p, "%2x", &v) != 1) return 0;
+            frame->data[n] = v;
+        }
+    }
+    v = strtoul(tok, &p, 16);
+    if(*p != '\0' || v > 0x7FF) return 0; /* Extended frames aren't ours */
+    frame->id = v;
+    return 1;
+}
+
+/* Puts the image back together from what the host sent on the channel
+   and keeps everything that isn't part of the update for the
+   background.  Returns the size of the image or -1. */
+static long
+load_log(const char *path)
+{
+    FILE *f;
+    char line[512];
+    struct sim_frame frame;
+    double t, t0 = -1, last = 0;
+    uint8_t page[256];
+    uint32_t fill_addr = 0, fill_len = 0, fill_off = 0, size = 0;
+    uint16_t chan = 0, crc = 0;
+    int done = 0, lines = 0, ok;
+
+    f = fopen(path, "r");
+    if(f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        ok = parse_line(line, &frame, &t);
+        if(ok == 0) continue;
+        /* Without times the frames are a millisecond apart */
+        if(t < 0) t = lines * 0.001;
+        lines++;
+        if(t0 < 0) {
+            if(frame.id >= FIX_NODE_SPECIFIC && frame.id < FIX_NODE_SPECIFIC + 256 &&
+               frame.length >= 5 && frame.data[0] == FIX_FIRMWARE &&
+               frame.data[2] == BL_VERIFY_LSB && frame.data[3] == BL_VERIFY_MSB &&
+               (!node_set || frame.data[1] == node)) {
+                t0 = t;
+                host = frame.id - FIX_NODE_SPECIFIC;
+                node = frame.data[1];
+                channel = frame.data[4] & 0x0F;
+                chan = FIX_2WAY_CHANNEL + channel * 2;
+            }
+            continue;
+        }
+        last = t;
+        if(!done && frame.id == chan) {
+            if(fill_off < fill_len) {
+                if(frame.length > 8) fd = 1;
+                if(fill_off + frame.length <= sizeof(page)) memcpy(page + fill_off, frame.data, frame.length);
+                fill_off += frame.length;
+            } else if(frame.data[0] == CMD_FILL && frame.length >= 7) {
+                fill_addr = get32(&frame.data[1]);
+                fill_len = frame.data[5] | frame.data[6] << 8;
+                fill_off = 0;
+                memset(page, 0xFF, sizeof(page));
+                if(fill_len > sizeof(page)) fill_len = sizeof(page);
+            } else if(frame.data[0] == CMD_WRITE && frame.length >= 5) {
+                if(fill_addr + fill_len <= sim_flash_size) memcpy(image + fill_addr, page, fill_len);
+            } else if(frame.data[0] == CMD_COMPLETE && frame.length >= 7) {
+                crc = frame.data[1] | frame.data[2] << 8;
+                size = get32(&frame.data[3]);
+                done = 1;
+            }
+            continue;
+        }
+        /* The node's answers and our repeated requests get made again */
+        if(frame.id == chan + 1 || frame.id == FIX_NODE_SPECIFIC + node) continue;
+        if(frame.id == FIX_NODE_SPECIFIC + host && frame.data[0] == FIX_FIRMWARE) continue;
+        bg = realloc(bg, (bg_count + 1) * sizeof(*bg));
+        if(bg == NULL) return -1;
+        bg[bg_count].t = (t - t0) * 1e9;
+        bg[bg_count++].frame = frame;
+    }
+    fclose(f);
+    if(t0 < 0 || !done || size == 0 || size > sim_flash_size) {
+        fprintf(stderr, "%s doesn't have a whole firmware update in it\n", path);
+        return -1;
+    }
+    if(fw_crc16(image, size) != crc) {
+        fprintf(stderr, "%s: the CRC doesn't match what was sent, some frames are missing\n", path);
+    }
+    if(!quiet) {
+        printf("%s: %.1f S, node 0x%02X from 0x%02X on channel %d, %d background frames\n",
+               path, last - t0, node, host, channel, bg_count);
+    }
+    return size;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: canfix-replay [options] candump.log\n"
+                    "       canfix-replay [options] -s firmware\n"
+                    "  -n node, picks the update out of the log or is the node for -s (0x22)\n"
+                    "  -c channel for -s            (0)\n"
+                    "  -b bus bit rate              (125000)\n"
+                    "  -d CAN FD data bit rate      (2000000)\n"
+                    "  -w frames that can wait for an answer (2)\n"
+                    "  -F sends the buffer data in 64 byte CAN FD frames with -s\n"
+                    "  -B percent of the bus to fill with random background frames\n"
+                    "  -L percent of frames to lose\n"
+                    "  -R percent of frame pairs to the node to swap\n"
+                    "  -N runs                      (1)\n"
+                    "  -S random seed               (1)\n"
+                    "  -u shows the bootloader's UART output\n"
+                    "  -q only prints the summary lines\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *firmware = NULL;
+    const struct sim_chip *chip;
+    long size, runs = 1, seed = 1, rate;
+    int c, i;
+
+    bus.recv = bus_recv;
+    bus.send = bus_send;
+    bus.bitrate = 125000;
+    bus.data_bitrate = 2000000;
+    while((c = getopt(argc, argv, "n:c:b:d:w:s:FB:L:R:N:S:uq")) != -1) {
+        switch(c) {
+        case 'n': node = strtol(optarg, NULL, 0); node_set = 1; break;
+        case 'c': channel = strtol(optarg, NULL, 0) & 0x0F; break;
+        case 'b': bus.bitrate = strtol(optarg, NULL, 0); break;
+        case 'd': bus.data_bitrate = strtol(optarg, NULL, 0); break;
+        case 'w': window = strtol(optarg, NULL, 0); break;
+        case 's': firmware = optarg; break;
+        case 'F': fd = 1; break;
+        case 'B': bg_load = strtod(optarg, NULL); break;
+        case 'L': loss = strtod(optarg, NULL); break;
+        case 'R': reorder = strtod(optarg, NULL); break;
+        case 'N': runs = strtol(optarg, NULL, 0); break;
+        case 'S': seed = strtol(optarg, NULL, 0); break;
+        case 'u': sim_uart = stdout; break;
+        case 'q': quiet = 1; break;
+        default: usage();
+        }
+    }
+    if((firmware == NULL) == (optind == argc) || optind < argc - 1 || window < 1 ||
+       runs < 1 || bg_load < 0 || bg_load >= 100 || loss < 0 || reorder < 0) usage();
+    for(rate = 0; rate < (long)(sizeof(rates) / sizeof(rates[0])) && rates[rate] != bus.bitrate; rate++);
+    if(rate == sizeof(rates) / sizeof(rates[0])) {
+        fprintf(stderr, "The bootloader can't run at %u bps\n", (unsigned)bus.bitrate);
+        return 1;
+    }
+
+    image = malloc(sim_flash_size);
+    flash = malloc(sim_flash_size);
+    eeprom = malloc(sim_eeprom_size);
+    if(image == NULL || flash == NULL || eeprom == NULL) return 1;
+    memset(image, 0xFF, sim_flash_size);
+    size = firmware ? fw_load(firmware, image, sim_flash_size) : load_log(argv[optind]);
+    if(size <= 0) return 1;
+    image_size = size;
+    ops = fw_ops(image, NULL, image_size, PGM_PAGE_SIZE, fd, &count);
+    if(ops == NULL) return 1;
+
+#ifdef CAN_MCP2517FD
+    chip = &sim_mcp2517fd;
+#else
+    chip = &sim_mcp2515;
+#endif
+    sim_virtual = 1;
+    sim_reset_hook = node_reset;
+    sim_start_app_hook = node_start_app;
+    srand(seed);
+    if(!quiet) {
+        printf("%s node 0x%02X at %u bps, %u bytes in %u pages, window %d, %ld runs\n",
+               chip->name, node, (unsigned)bus.bitrate, image_size,
+               (image_size + PGM_PAGE_SIZE - 1) / PGM_PAGE_SIZE, window, runs);
+    }
+    for(i = 0; i < runs; i++) run_once(chip, rate);
+
+    printf("Runs:");
+    for(i = RUN_GOOD; i <= RUN_TOO_LONG; i++) {
+        if(i == RUN_GOOD || total.result[i]) printf(" %u %s", total.result[i], run_results[i]);
+    }
+    putchar('\n');
+    printf("Frames: %u sent, %u answers, %u background, %u lost, %u dropped by the controller,"
+           " %u pairs swapped, %u pages started over\n", total.sent, total.answers,
+           total.background, total.lost, total.rx_overflows, total.reordered, total.page_retries);
+    print_samples(&cmd_times);
+    print_samples(&page_times);
+    print_samples(&session_times);
+    return total.result[RUN_GOOD] == runs ? 0 : 1;
+}
@@ -0,0 +1,537 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This is the AVR side of the simulator.  It takes the place of cutil.c
+ *  and util.S and implements the stand-in AVR headers: the clock, timer 1,
+ *  the UART, SPI, the flash self programming and the EEPROM.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/delay_basic.h>
+#include "bootloader.h"
+#include "util.h"
+#include "stats.h"
+#include "sim.h"
+
+#ifdef __AVR_ATmega2561__
+  #define SIM_NRWW_START 0x3E000UL /* Start of the No Read While Write section */
+#else
+  #define SIM_NRWW_START 0x7000UL
+#endif
+#define SIM_SPM_TIME    4000000ULL /* Page erase or write, nS */
+#define SIM_EEPROM_TIME 3400000ULL /* EEPROM byte write, nS */
+#define SIM_CS_CYCLES   256        /* Timer 0 wrap between SPI transfers */
+#define SIM_SPI_BYTE_OVERHEAD 10   /* CPU cycles per byte outside of the shifting */
+#define CYCLES_NS(c) ((uint64_t)(c) * 1000000000ULL / sim_clock())
+
+const uint32_t sim_flash_size = FLASHEND + 1UL;
+const uint32_t sim_eeprom_size = E2END + 1UL;
+
+volatile uint8_t sim_io[64];
+volatile uint8_t sim_interrupts;
+struct sim_bus *sim_bus;
+struct sim_stats sim_stats;
+int sim_virtual;
+int sim_fast;
+FILE *sim_uart;
+
+static void default_reset(void);
+
+/* The CPU clock.  The oscillator is BOOT_F_CPU and the fuses or the
+   bootloader divide it down with CLKPR. */
+static uint32_t
+sim_clock(void)
+{
+    return BOOT_F_CPU >> (CLKPR & 0x0F);
+}
+static void default_start_app(void);
+void (*sim_reset_hook)(void) = default_reset;
+void (*sim_start_app_hook)(void) = default_start_app;
+
+static const struct sim_chip *chip;
+static uint8_t *flash;
+static uint8_t *eeprom;
+
+/* Time */
+static uint64_t virtual_now;
+static uint64_t sleep_debt;
+static struct timespec start_time;
+
+uint64_t
+sim_now(void)
+{
+    struct timespec ts;
+
+    if(sim_virtual) return virtual_now;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - start_time.tv_sec) * 1000000000ULL +
+           ts.tv_nsec - start_time.tv_nsec + (sim_fast ? sleep_debt : 0);
+}
+
+/* The bootloader is busy for ns nano seconds.  In real time mode we keep
+   track of how much time we owe and sleep it off in chunks that the host
+   can actually do.  The fast mode never sleeps and moves the clock ahead
+   instead. */
+static int uart_wants_service(void);
+static void uart_service(void);
+static uint64_t uart_free;
+
+void
+sim_spend(uint64_t ns)
+{
+    struct timespec ts;
+    uint64_t end, isr_start;
+
+    if(sim_virtual) {
+        /* Every character that the UART would have finished while we
+           were busy gets its interrupt at the time that it happened. */
+        end = virtual_now + ns;
+        while(uart_wants_service() && uart_free < end) {
+            if(uart_free > virtual_now) virtual_now = uart_free;
+            isr_start = virtual_now;
+            uart_service();
+            end += virtual_now - isr_start; /* Time the interrupt took from us */
+        }
+        virtual_now = end;
+        uart_service();
+        return;
+    }
+    sleep_debt += ns;
+    uart_service();
+    if(sim_fast || sleep_debt < 200000) return;
+    ts.tv_sec = sleep_debt / 1000000000ULL;
+    ts.tv_nsec = sleep_debt % 1000000000ULL;
+    nanosleep(&ts, NULL);
+    sleep_debt = 0;
+}
+
+void
+sim_cycles(uint32_t cycles)
+{
+    sim_spend(CYCLES_NS(cycles));
+}
+
+/* Roughly how long a frame takes on the bus, stuff bits included.  The
+   fixed parts are the overhead of a standard frame up to the end of the
+   interframe space. */
+uint64_t
+sim_frame_time(const struct sim_frame *frame, uint32_t bitrate, uint32_t data_bitrate)
+{
+    uint32_t nominal, data;
+
+    if(!(frame->flags & SIM_FD)) {
+        nominal = 47 + 8 * frame->length;
+        nominal += (34 + 8 * frame->length) / 8;
+        return (uint64_t)nominal * 1000000000ULL / bitrate;
+    }
+    nominal = 30 + 12;                                 /* Arbitration, ACK and EOF */
+    data = 5 + 4 + 8 * frame->length;                  /* ESI, DLC, data and stuff count */
+    data += frame->length > 16 ? 21 + 6 : 17 + 5;      /* CRC with fixed stuff bits */
+    data += data / 8;
+    if(!(frame->flags & SIM_BRS)) data_bitrate = bitrate;
+    return (uint64_t)nominal * 1000000000ULL / bitrate +
+           (uint64_t)data * 1000000000ULL / data_bitrate;
+}
+
+/* Timer 1.  The count is worked out from the clock each time somebody
+   looks at it.  If the bootloader wrote a new count since the last time
+   then we start counting from there.  Reading it costs a few cycles so
+   that loops that do nothing but watch the timer still move virtual
+   time along. */
+volatile uint16_t *
+sim_tcnt1(void)
+{
+    static const uint16_t prescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    static volatile uint16_t count;
+    static uint16_t last_count;
+    static uint8_t last_cs, last_clkpr;
+    static uint64_t base_time, last_time;
+    static uint32_t base_count;
+    uint8_t cs = TCCR1B & 0x07;
+    uint64_t now;
+
+    sim_cycles(4);
+    now = sim_now();
+    if(count != last_count || cs != last_cs || CLKPR != last_clkpr) {
+        base_time = last_time;
+        base_count = count;
+        last_cs = cs;
+        last_clkpr = CLKPR;
+    }
+    if(prescale[cs]) {
+        count = base_count + (now - base_time) * (sim_clock() / prescale[cs]) / 1000000000ULL;
+    }
+    last_count = count;
+    last_time = now;
+    return &count;
+}
+
+/* UART.  The byte written to UDR0 goes out the next time the UART is
+   touched.  The data register isn't empty again until the byte would
+   have been shifted out at the programmed baud rate. */
+static volatile uint8_t ucsr0a = (1 << UDRE0);
+static volatile uint8_t ucsr0b;
+static volatile uint8_t udr0;
+static uint8_t udr0_pending;
+static uint8_t in_isr;
+
+/* Stands in for the logger when the bootloader is built without it */
+__attribute__((weak)) void
+sim_uart_udre_vect(void)
+{
+    ucsr0b &= ~(1 << UDRIE0);
+}
+
+static void
+uart_flush(void)
+{
+    uint32_t divider;
+
+    if(!udr0_pending) return;
+    udr0_pending = 0;
+    if(sim_uart) {
+        fputc(udr0, sim_uart);
+        if(udr0 == '\n') fflush(sim_uart);
+    }
+    divider = (ucsr0a & (1 << U2X0) ? 8UL : 16UL) * ((UBRR0H << 8 | UBRR0L) + 1);
+    uart_free = sim_now() + 10ULL * 1000000000ULL * divider / sim_clock();
+}
+
+volatile uint8_t *
+sim_ucsr0a(void)
+{
+    uint64_t now;
+
+    uart_flush();
+    now = sim_now();
+    if(now < uart_free) {
+        sim_spend(uart_free - now); /* Nothing else happens while we wait */
+        ucsr0a &= ~((1 << UDRE0) | (1 << TXC0));
+    } else {
+        ucsr0a |= (1 << UDRE0) | (1 << TXC0);
+    }
+    return &ucsr0a;
+}
+
+volatile uint8_t *
+sim_ucsr0b(void)
+{
+    sim_cycles(1);
+    return &ucsr0b;
+}
+
+volatile uint8_t *
+sim_udr0(void)
+{
+    uart_flush();
+    udr0_pending = 1;
+    return &udr0;
+}
+
+/* The interrupt can only happen while the bootloader is running and not
+   in the middle of the interrupt already. */
+static int
+uart_wants_service(void)
+{
+    return sim_interrupts && !in_isr && (ucsr0b & (1 << UDRIE0));
+}
+
+/* Runs the data register empty interrupt once if it is due */
+static void
+uart_service(void)
+{
+    if(!uart_wants_service()) return;
+    uart_flush();
+    if(sim_now() < uart_free) return;
+    in_isr = 1;
+    sim_uart_udre_vect();
+    uart_flush();
+    in_isr = 0;
+}
+
+/* SPI.  This replaces the one in cutil.c.  The time that it takes is the
+   chip select gap that timer 0 gives us plus the shifting at whatever
+   rate SPCR and SPSR are set for. */
+void
+spi_write(uint8_t *write_buff, uint8_t *read_buff, uint8_t size)
+{
+    static const uint8_t divider[4] = {4, 16, 64, 128};
+    static uint64_t last_end;
+    uint64_t now = sim_now();
+    uint32_t div;
+
+    if(now - last_end < CYCLES_NS(SIM_CS_CYCLES)) {
+        sim_spend(CYCLES_NS(SIM_CS_CYCLES) - (now - last_end));
+    }
+    div = divider[SPCR & 0x03];
+    if(SPSR & (1 << SPI2X)) div /= 2;
+    sim_cycles(size * (8 * div + SIM_SPI_BYTE_OVERHEAD));
+    sim_stats.spi_transfers++;
+    sim_stats.spi_bytes += size;
+    chip->spi(write_buff, read_buff, size);
+    STAT_INC(spi);
+    last_end = sim_now();
+}
+
+/* Flash self programming */
+static uint16_t page_buffer[SPM_PAGESIZE / 2];
+static uint8_t page_filled[SPM_PAGESIZE / 2];
+static uint8_t rww_busy;
+static uint64_t spm_free;
+
+static void
+page_buffer_clear(void)
+{
+    memset(page_filled, 0, sizeof(page_filled));
+}
+
+/* Waits for the last SPM operation to finish and starts timing this one.
+   The CPU is halted for the whole time when the page is in the NRWW
+   section. */
+static void
+spm_start(uint32_t addr)
+{
+    uint64_t now = sim_now();
+
+    if(now < spm_free) sim_spend(spm_free - now);
+    spm_free = sim_now() + SIM_SPM_TIME;
+    if(addr >= SIM_NRWW_START) {
+        sim_spend(SIM_SPM_TIME);
+    } else {
+        rww_busy = 1;
+    }
+}
+
+int
+sim_spm_busy(void)
+{
+    sim_cycles(2);
+    return sim_now() < spm_free;
+}
+
+/* The application section can't be read until boot_rww_enable() */
+int
+sim_rww_busy(void)
+{
+    sim_cycles(2);
+    return rww_busy;
+}
+
+void
+sim_page_fill(uint32_t addr, uint16_t data)
+{
+    uint8_t i = (addr % SPM_PAGESIZE) / 2;
+
+    if(!page_filled[i]) {
+        page_buffer[i] = data;
+        page_filled[i] = 1;
+    }
+}
+
+void
+sim_page_erase(uint32_t addr)
+{
+    addr = addr % sim_flash_size & ~(SPM_PAGESIZE - 1UL);
+    spm_start(addr);
+    memset(flash + addr, 0xFF, SPM_PAGESIZE);
+    sim_stats.page_erases++;
+}
+
+/* Programming can only clear bits */
+void
+sim_page_write(uint32_t addr)
+{
+    uint16_t i;
+
+    addr = addr % sim_flash_size & ~(SPM_PAGESIZE - 1UL);
+    spm_start(addr);
+    for(i = 0; i < SPM_PAGESIZE / 2; i++) {
+        if(page_filled[i]) {
+            flash[addr + 2 * i] &= page_buffer[i] & 0xFF;
+            flash[addr + 2 * i + 1] &= page_buffer[i] >> 8;
+        }
+    }
+    page_buffer_clear();
+    sim_stats.page_writes++;
+}
+
+void
+sim_rww_enable(void)
+{
+    uint64_t now = sim_now();
+
+    if(now < spm_free) sim_spend(spm_free - now);
+    rww_busy = 0;
+    page_buffer_clear();
+}
+
+uint8_t
+sim_pgm_read_byte(uintptr_t addr)
+{
+    sim_cycles(3);
+    if(addr >= sim_flash_size) return *(const uint8_t *)addr; /* PROGMEM table */
+    if(rww_busy && addr < SIM_NRWW_START) return 0xFF;
+    return flash[addr];
+}
+
+/* EEPROM.  A write also throws away whatever is in the page buffer, the
+   same as the hardware. */
+static uint64_t eeprom_free;
+
+int
+sim_eeprom_ready(void)
+{
+    sim_cycles(2);
+    return sim_now() >= eeprom_free;
+}
+
+uint8_t
+eeprom_read_byte(const uint8_t *addr)
+{
+    eeprom_busy_wait();
+    sim_cycles(4);
+    return eeprom[(uintptr_t)addr % sim_eeprom_size];
+}
+
+uint16_t
+eeprom_read_word(const uint16_t *addr)
+{
+    return eeprom_read_byte((const uint8_t *)addr) |
+           eeprom_read_byte((const uint8_t *)addr + 1) << 8;
+}
+
+void
+eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++) {
+        ((uint8_t *)dst)[i] = eeprom_read_byte((const uint8_t *)src + i);
+    }
+}
+
+void
+eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+    eeprom_busy_wait();
+    eeprom[(uintptr_t)addr % sim_eeprom_size] = value;
+    eeprom_free = sim_now() + SIM_EEPROM_TIME;
+    page_buffer_clear();
+    sim_stats.eeprom_writes++;
+}
+
+void
+eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+    if(eeprom_read_byte(addr) != value) eeprom_write_byte(addr, value);
+}
+
+void
+eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++) {
+        eeprom_update_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+    }
+}
+
+/* util.S */
+void
+reset(void)
+{
+    uart_flush();
+    if(sim_uart) fflush(sim_uart);
+    sim_reset_hook();
+    exit(1);
+}
+
+void
+start_app(void)
+{
+    uart_flush();
+    if(sim_uart) fflush(sim_uart);
+    sim_start_app_hook();
+    exit(1);
+}
+
+static void
+default_reset(void)
+{
+    fprintf(stderr, "sim: reset\n");
+    exit(0);
+}
+
+static void
+default_start_app(void)
+{
+    fprintf(stderr, "sim: application started\n");
+    exit(0);
+}
+
+char *
+itoa(int value, char *str, int radix)
+{
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    unsigned int v = (radix == 10 && value < 0) ? (unsigned int)-value : (unsigned int)value;
+    char *p = str, *q;
+    char c;
+
+    if(radix == 10 && value < 0) *p++ = '-';
+    q = p;
+    do {
+        *p++ = digits[v % radix];
+        v /= radix;
+    } while(v);
+    *p-- = '\0';
+    while(q < p) { /* Digits came out backwards */
+        c = *q;
+        *q++ = *p;
+        *p-- = c;
+    }
+    return str;
+}
+
+void
+sim_init(const struct sim_chip *c, struct sim_bus *bus, uint8_t *f, uint8_t *e)
+{
+    chip = c;
+    sim_bus = bus;
+    flash = f;
+    eeprom = e;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    virtual_now = 0;
+    sleep_debt = 0;
+    memset((void *)sim_io, 0, sizeof(sim_io));
+    MCUSR = (1 << EXTRF);
+#ifdef CLOCK_BOOST
+    CLKPR = CLOCK_BOOST_PS; /* CKDIV8 or whatever the fuses say */
+#endif
+    ucsr0a = (1 << UDRE0);
+    udr0_pending = 0;
+    uart_free = spm_free = eeprom_free = 0;
+    rww_busy = 0;
+    page_buffer_clear();
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    chip->reset();
+}
@@ -0,0 +1,107 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This is the interface between the host side of the simulator and the
+ *  bootloader code that runs on top of it.  The bootloader is compiled
+ *  for the host with the stand-in AVR headers in this directory.  Its SPI
+ *  traffic goes to a register level model of the CAN controller and the
+ *  controller model talks to a simulated bus.
+ *
+ *  Nothing in here includes the AVR headers so the programs that drive
+ *  the simulator don't have to either.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A frame on the simulated bus.  Only standard identifiers are used. */
+#define SIM_FD  0x01 /* CAN FD frame */
+#define SIM_BRS 0x02 /* Bit rate switched for the data phase */
+struct sim_frame {
+    uint16_t id;
+    uint8_t length;
+    uint8_t flags;
+    uint8_t data[64];
+};
+
+/* The rest of the bus as the controller sees it.  recv() returns 1 and
+   fills in the frame if one is waiting, 0 if not.  The bit rates are
+   what everybody else on the bus is using.  A controller that is set up
+   for something else sees errors instead of frames. */
+struct sim_bus {
+    int (*recv)(struct sim_frame *frame);
+    void (*send)(const struct sim_frame *frame);
+    uint32_t bitrate;
+    uint32_t data_bitrate;
+};
+
+/* A CAN controller model.  spi() is one whole chip select cycle.  The
+   write and read buffers may be the same buffer. */
+struct sim_chip {
+    const char *name;
+    void (*reset)(void);
+    void (*spi)(const uint8_t *write_buff, uint8_t *read_buff, uint8_t size);
+};
+extern const struct sim_chip sim_mcp2515;
+extern const struct sim_chip sim_mcp2517fd;
+
+/* Memory sizes of the part the bootloader was compiled for */
+extern const uint32_t sim_flash_size;
+extern const uint32_t sim_eeprom_size;
+
+/* Time.  In real time mode the simulator sleeps to make the bootloader
+   take as long as it would on the hardware.  sim_fast skips the sleeping
+   but keeps the clock honest.  In virtual time mode the clock only moves
+   when the bootloader spends time and sim_now() is the only clock there
+   is. */
+extern int sim_virtual;
+extern int sim_fast;
+uint64_t sim_now(void); /* nanoseconds */
+void sim_spend(uint64_t ns);
+uint64_t sim_frame_time(const struct sim_frame *frame, uint32_t bitrate, uint32_t data_bitrate);
+
+/* What happens when the bootloader calls reset() or start_app().  Neither
+   may return. */
+extern void (*sim_reset_hook)(void);
+extern void (*sim_start_app_hook)(void);
+
+/* Where the UART debug output goes.  NULL throws it away. */
+extern FILE *sim_uart;
+
+/* Statistics */
+struct sim_stats {
+    uint32_t spi_transfers;
+    uint32_t spi_bytes;
+    uint32_t page_erases;
+    uint32_t page_writes;
+    uint32_t eeprom_writes;
+    uint32_t rx_overflows;  /* Frames the controller had no room for */
+};
+extern struct sim_stats sim_stats;
+
+/* Sets everything up.  The flash and EEPROM images must be sim_flash_size
+   and sim_eeprom_size bytes.  Resets the controller model as well. */
+void sim_init(const struct sim_chip *chip, struct sim_bus *bus, uint8_t *flash, uint8_t *eeprom);
+extern struct sim_bus *sim_bus;
+
+/* The bootloader's main() */
+int bl_main(void);
+
+#endif
@@ -0,0 +1,195 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Runs the bootloader as a node on a Linux SocketCAN interface, usually
+ *  a vcan, so that the firmware upload tools can be tried out without
+ *  any hardware.  The flash and EEPROM are kept in files so a program
+ *  that gets loaded is still there the next time.  A reset starts the
+ *  whole program over and starting the application just exits.
+ *
+ *  Build it from the top of the repository with
+ *
+ *    gcc -O2 -Wall -std=gnu99 -funsigned-char -D__AVR_ATmega328P__ \
+ *        -Itools/sim -Itools -IAVRBootloader -o canfix-simnode \
+ *        AVRBootloader/main.c AVRBootloader/log.c AVRBootloader/can.c \
+ *        AVRBootloader/can_mcp2517fd.c \
+ *        tools/sim/sim.c tools/sim/model_mcp2515.c tools/sim/model_mcp2517fd.c \
+ *        tools/sim/simnode.c tools/socketcan.c
+ *
+ *  Add -DCAN_MCP2517FD to build it with the MCP2517FD driver and model.
+ *  Then
+ *
+ *    ip link add dev vcan0 type vcan && ip link set vcan0 mtu 72 up
+ *    ./canfix-simnode -i vcan0 -n 0x22 -r 0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "sim.h"
+#include "socketcan.h"
+
+static const uint32_t rates[] = {125000, 250000, 500000, 1000000, 50000, 100000, 800000};
+
+static int sock = -1;
+static char **saved_argv;
+
+static int
+bus_recv(struct sim_frame *frame)
+{
+    struct canfd_frame cf;
+    int fd;
+
+    if(sc_recv(sock, &cf, &fd, 0) != 1) return 0;
+    if(cf.can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) return 0;
+    frame->id = cf.can_id & CAN_SFF_MASK;
+    frame->length = cf.len;
+    frame->flags = fd ? SIM_FD : 0;
+    if(fd && (cf.flags & CANFD_BRS)) frame->flags |= SIM_BRS;
+    memcpy(frame->data, cf.data, cf.len);
+    return 1;
+}
+
+static void
+bus_send(const struct sim_frame *frame)
+{
+    struct canfd_frame cf;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.can_id = frame->id;
+    cf.len = frame->length;
+    cf.flags = frame->flags & SIM_BRS ? CANFD_BRS : 0;
+    memcpy(cf.data, frame->data, frame->length);
+    if(sc_send(sock, &cf, frame->flags & SIM_FD) < 0) perror("simnode: send");
+}
+
+static struct sim_bus bus = {bus_recv, bus_send, 125000, 2000000};
+
+/* Opens the image file and maps it.  A new file is filled with 0xFF like
+   an erased part. */
+static uint8_t *
+map_image(const char *path, uint32_t size)
+{
+    uint8_t *p;
+    off_t old;
+    int f;
+
+    f = open(path, O_RDWR | O_CREAT, 0644);
+    if(f < 0) {
+        perror(path);
+        exit(1);
+    }
+    old = lseek(f, 0, SEEK_END);
+    if(old < size) {
+        if(ftruncate(f, size) < 0) {
+            perror(path);
+            exit(1);
+        }
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if(p == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    if(old < size) memset(p + old, 0xFF, size - old);
+    close(f);
+    return p;
+}
+
+static void
+node_reset(void)
+{
+    fprintf(stderr, "simnode: reset\n");
+    execv("/proc/self/exe", saved_argv);
+    perror("simnode: execv");
+    exit(1);
+}
+
+static void
+node_start_app(void)
+{
+    fprintf(stderr, "simnode: application started\n");
+    exit(0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: canfix-simnode [-i interface] [-n node] [-r rate] [-b bus bitrate]\n"
+                    "                      [-d data bitrate] [-f flash file] [-e eeprom file] [-F] [-q]\n"
+                    "  -n and -r are written to the EEPROM.  -b defaults to the node's rate.\n"
+                    "  -F doesn't slow down to the speed of the real hardware.\n"
+                    "  -q throws away the UART debug output.\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *ifname = "vcan0", *flash_file = "simnode.flash", *eeprom_file = "simnode.eeprom";
+    long node = -1, rate = -1, bitrate = 0;
+    uint8_t *flash, *eeprom;
+    const struct sim_chip *chip;
+    int c;
+
+    saved_argv = argv;
+    sim_uart = stderr;
+    while((c = getopt(argc, argv, "i:n:r:b:d:f:e:Fq")) != -1) {
+        switch(c) {
+        case 'i': ifname = optarg; break;
+        case 'n': node = strtol(optarg, NULL, 0); break;
+        case 'r': rate = strtol(optarg, NULL, 0); break;
+        case 'b': bitrate = strtol(optarg, NULL, 0); break;
+        case 'd': bus.data_bitrate = strtol(optarg, NULL, 0); break;
+        case 'f': flash_file = optarg; break;
+        case 'e': eeprom_file = optarg; break;
+        case 'F': sim_fast = 1; break;
+        case 'q': sim_uart = NULL; break;
+        default: usage();
+        }
+    }
+
+    flash = map_image(flash_file, sim_flash_size);
+    eeprom = map_image(eeprom_file, sim_eeprom_size);
+    if(node >= 0) eeprom[1] = node;
+    if(rate >= 0) eeprom[0] = rate;
+    if(bitrate) {
+        bus.bitrate = bitrate;
+    } else if(eeprom[0] < sizeof(rates) / sizeof(rates[0])) {
+        bus.bitrate = rates[eeprom[0]];
+    }
+
+#ifdef CAN_MCP2517FD
+    chip = &sim_mcp2517fd;
+#else
+    chip = &sim_mcp2515;
+#endif
+    sock = sc_open(ifname, 1);
+    if(sock < 0) {
+        perror(ifname);
+        return 1;
+    }
+    sim_reset_hook = node_reset;
+    sim_start_app_hook = node_start_app;
+    sim_init(chip, &bus, flash, eeprom);
+    fprintf(stderr, "simnode: %s node 0x%02X on %s at %u bps\n", chip->name, eeprom[1],
+            ifname, (unsigned)bus.bitrate);
+    return bl_main();
+}
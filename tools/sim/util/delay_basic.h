@@ -0,0 +1,31 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Stand-in for <util/delay_basic.h> for the host simulator.
+ */
+
+#ifndef SIM_UTIL_DELAY_BASIC_H
+#define SIM_UTIL_DELAY_BASIC_H
+
+#include <stdint.h>
+
+void sim_cycles(uint32_t cycles);
+
+#define _delay_loop_1(count) sim_cycles(3UL * ((count) ? (count) : 256))
+#define _delay_loop_2(count) sim_cycles(4UL * ((count) ? (count) : 65536))
+
+#endif
@@ -0,0 +1,79 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/can/raw.h>
+#include "socketcan.h"
+
+int
+sc_open(const char *ifname, int fd)
+{
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int s;
+
+    s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if(s < 0) return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if(ioctl(s, SIOCGIFINDEX, &ifr) < 0) goto fail;
+    if(fd && setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &fd, sizeof(fd)) < 0) goto fail;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto fail;
+    return s;
+fail:
+    close(s);
+    return -1;
+}
+
+int
+sc_send(int s, const struct canfd_frame *frame, int fd)
+{
+    size_t size = fd ? CANFD_MTU : CAN_MTU;
+
+    return write(s, frame, size) == (ssize_t)size ? 0 : -1;
+}
+
+int
+sc_recv(int s, struct canfd_frame *frame, int *fd, int timeout_ms)
+{
+    struct pollfd p;
+    ssize_t n;
+
+    p.fd = s;
+    p.events = POLLIN;
+    n = poll(&p, 1, timeout_ms);
+    if(n <= 0) return n;
+    n = read(s, frame, sizeof(*frame));
+    if(n == CAN_MTU) {
+        if(fd) *fd = 0;
+        return 1;
+    }
+    if(n == CANFD_MTU) {
+        if(fd) *fd = 1;
+        return 1;
+    }
+    return -1;
+}
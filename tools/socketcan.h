@@ -0,0 +1,40 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P 
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Small wrapper around Linux SocketCAN raw sockets for the host tools.
+ *  Classic and FD frames both use struct canfd_frame.
+ */
+
+#ifndef SOCKETCAN_H
+#define SOCKETCAN_H
+
+#include <linux/can.h>
+
+/* Opens a raw socket on the interface.  If fd is set the socket also
+   takes CAN FD frames.  Returns the socket or -1. */
+int sc_open(const char *ifname, int fd);
+
+/* Sends a frame.  fd says whether it goes out as an FD frame.  Returns 0
+   or -1. */
+int sc_send(int s, const struct canfd_frame *frame, int fd);
+
+/* Waits up to timeout_ms for a frame.  0 doesn't wait at all and -1 waits
+   forever.  Returns 1 with the frame, and *fd set if it was an FD frame,
+   0 on timeout and -1 on error. */
+int sc_recv(int s, struct canfd_frame *frame, int *fd, int timeout_ms);
+
+#endif
@@ -0,0 +1,803 @@
+/*  CANFix Bootloader - An Open Source CAN Fix Bootloader for ATMega328P
+ *  Copyright (c) 2012 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Uploads firmware to nodes running the bootloader over a Linux
+ *  SocketCAN interface.  This is the host side of load_firmware() in
+ *  main.c.
+ *
+ *  Every page is erased, filled and written and the new image's CRC and
+ *  size go out with the Complete command.  A node with BL_CRC_CHECK
+ *  checks the CRC against its flash before it stores it and answers with
+ *  the CRC that it got instead if they don't match.  Then we send the
+ *  whole thing again while it's still listening.  The node answers every frame
+ *  in order, so instead of waiting for each answer we keep up to -w
+ *  frames in flight.  That way the next page's commands are already
+ *  waiting in the node while it finishes the last one.  A few frames
+ *  have to wait for everything before them to be answered, see fw_ops()
+ *  in fwimage.h.  The MCP2515 only has two receive buffers so more than
+ *  two in flight can lose frames.
+ *
+ *  Several nodes can be updated at once.  Each one gets its own two way
+ *  channel, so up to 16 can be going at a time.  The nodes take turns
+ *  sending one frame each and all of the frames, answers included, come
+ *  out of one budget of bus time (-b and -l) so the rest of the bus keeps
+ *  working.  A node that stops answering is started over from the
+ *  beginning up to -r times.
+ *
+ *  Build it from the top of the repository with
+ *
+ *    gcc -O2 -Wall -std=gnu99 -IAVRBootloader -Itools -o canfix-upload \
+ *        tools/upload.c tools/fwimage.c tools/socketcan.c
+ *
+ *  and try it against canfix-simnode (see tools/sim/simnode.c) with
+ *
+ *    ./canfix-upload -i vcan0 -n 0x22 firmware.hex
+ *
+ *  or for more than one node
+ *
+ *    ./canfix-upload -i vcan0 0x22:engine.hex 0x23:fuel.hex 0x24:engine.hex
+ *
+ *  The nodes answer everything as fast as they can at priority 3.  -p
+ *  and -P change the priority and the time between answers, which slows
+ *  the upload down since we wait on them.  With -a the nodes put their
+ *  error counters and how many of their answers lost arbitration in the
+ *  buffer data answers.  When those say the bus is busy our share of it
+ *  is cut in half and every clean answer wins a little of it back.  The
+ *  nodes need BL_PACING for any of these.
+ *
+ *  -e writes an EEPROM image too.  Only the bytes that are in the file
+ *  are sent and the node skips the ones that are already right, then we
+ *  read them all back before the Complete command.  Give - instead of the
+ *  firmware to only do the EEPROM, the node is reset when it's done.  The
+ *  nodes need BL_EEPROM for this.
+ *
+ *  If we know what a node has now, -o or node:file:old only sends the
+ *  bytes that changed.  The new file goes on top of the old one so a
+ *  HEX file with just a few records is a patch.  The CRC is worked out
+ *  over the two together, so if the node didn't really have the old
+ *  image it won't start the application afterwards.
+ *
+ *  -A works out -w and the time between frames for each node while it
+ *  goes.  Clean answers take away the gap and then let one more frame
+ *  wait, a lost frame puts it back and the window that lost it becomes
+ *  that node's ceiling.  Answers that take much longer than the quickest
+ *  one mean the node's buffers are backing up so it stops there.  The
+ *  first time costs a lost page or two, -T keeps what it learned in a
+ *  file so the next upload starts there.  The bitrate is the whole bus's
+ *  so -b stays the same for everyone.
+ *
+ *  The firmware can be Intel HEX, an AVR ELF file, a raw binary or a
+ *  transfer plan from canfix-pack (see pack.c), which already has every
+ *  frame worked out.  A plan has to be packed with the same -m and -F.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bootloader.h"
+#include "fix.h"
+#include "fwimage.h"
+#include "socketcan.h"
+
+#define ACK_TIMEOUT   1500  /* mS.  A bit longer than the node waits for a frame */
+#define MAX_RETRIES   3     /* Times we start a page over */
+#define CONNECT_RETRY 50    /* mS between firmware requests */
+#define NODE_GIVES_UP 32000 /* mS.  load_firmware() returns after 30 timeouts */
+#define BURST_MS      10    /* How much unused bus time we save up */
+#define MAX_CHANNELS  16
+#define MAX_WINDOW    16    /* -A doesn't try more than this */
+#define TUNE_ACKS     24    /* Clean answers before -A tries going faster */
+
+/* Where a node's upload is at */
+#define JOB_WAITING    0 /* Waiting for a free channel */
+#define JOB_CONNECTING 1
+#define JOB_SENDING    2
+#define JOB_DONE       3
+#define JOB_FAILED     4
+
+/* One node's upload */
+struct job {
+    uint8_t node;
+    const char *path;
+    struct op *ops;
+    int count;
+    int state;
+    int channel;
+    uint16_t chan_id;  /* Where its commands go */
+    int next;          /* The next frame to send */
+    int oldest;        /* The oldest frame that hasn't been answered */
+    int retries;       /* Times the current page has been started over */
+    int attempts;      /* Times the whole upload has been started */
+    int resends;       /* Times the node's CRC didn't match */
+    double hold;       /* Nothing goes out before this */
+    double deadline;   /* When we give up asking the node to start */
+    double start;
+    uint8_t tec, rec;  /* The node's error counters from its last report */
+    int window;        /* Frames that can wait for an answer */
+    int ceiling;       /* The most window can be, -A lowers it when frames get lost */
+    double gap;        /* mS between frames */
+    double last;       /* When the last frame went */
+    double latency;    /* Average mS for an answer */
+    double fastest;    /* Quickest answer so far */
+    int clean;         /* Answers since something got lost or we sped up */
+};
+
+/* What -A learned about a node, kept in the -T file */
+struct profile {
+    int valid;
+    int window, ceiling;
+    double gap, latency;
+};
+
+static int sock = -1;
+static int quiet;
+static const struct fw_part *part = &fw_parts[0];
+static uint8_t host = 0x01;
+static int window = 2;
+static int timeout = 10;     /* Seconds to keep asking a node to start */
+static int node_retries = 1; /* Times a node is started over */
+static const char *old_path; /* What the nodes have now */
+static const char *ee_path;  /* What goes in the nodes' EEPROM */
+static double bitrate = 125000, data_bitrate;
+static double bus_rate;      /* Bit times per mS that we let ourselves use */
+static double bus_max;       /* bus_rate before -a cut it back */
+static int backoffs;
+static int priority = -1, pace, adapt;
+static int autotune;
+static const char *profile_path;
+static struct profile profiles[256];
+static double bus_credit, bus_last;
+static double chan_free[MAX_CHANNELS]; /* When a node stops listening on each channel */
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+static int
+send_frame(uint16_t id, const uint8_t *data, uint8_t length, int fd)
+{
+    struct canfd_frame cf;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.can_id = id;
+    cf.len = length;
+    if(fd) cf.flags = CANFD_BRS;
+    memcpy(cf.data, data, length);
+    if(sc_send(sock, &cf, fd) < 0) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+/* Roughly how many bit times at the arbitration rate a frame takes,
+   with about the amount of bit stuffing that random data gets.  The data
+   part of an FD frame goes at the data rate. */
+static double
+frame_bits(uint8_t length, int fd)
+{
+    double bits;
+
+    if(fd) bits = 30 + (30 + 8 * length) * bitrate / data_bitrate;
+    else bits = 47 + 8 * length;
+    return bits + bits / 5;
+}
+
+/* Takes the frame and its answer out of the bus budget.  Returns 0 if
+   there isn't enough bus time left for it yet.  The budget can go below
+   zero so that a frame bigger than the burst still gets out. */
+static int
+bus_take(const struct op *op)
+{
+    double t = now_ms();
+
+    bus_credit += (t - bus_last) * bus_rate;
+    bus_last = t;
+    if(bus_credit > bus_rate * BURST_MS) bus_credit = bus_rate * BURST_MS;
+    if(bus_credit <= 0) return 0;
+    bus_credit -= frame_bits(op->length, op->fd) + frame_bits(op->ack_length, 0);
+    return 1;
+}
+
+/* Looks at the bus report in a buffer data answer.  Answers that lost
+   arbitration or error counters that went up mean the bus is busy. */
+static void
+bus_adjust(struct job *j, const struct canfd_frame *cf)
+{
+    if(cf->data[4] > 0 || cf->data[2] > j->tec || cf->data[3] > j->rec) {
+        if(bus_rate > bus_max / 16) backoffs++;
+        bus_rate /= 2;
+        if(bus_rate < bus_max / 16) bus_rate = bus_max / 16;
+    } else {
+        bus_rate += bus_max / 32;
+        if(bus_rate > bus_max) bus_rate = bus_max;
+    }
+    j->tec = cf->data[2];
+    j->rec = cf->data[3];
+}
+
+/* -A.  The answers tell us how the node is keeping up.  After
+   TUNE_ACKS clean ones in a row we take away some of the gap between
+   frames, or once that's gone let one more frame wait for an answer.
+   If the answers are taking a lot longer than the quickest one the
+   node's receive buffers are backing up so we stay where we are. */
+static void
+tune_answer(struct job *j, double ms)
+{
+    j->latency = j->latency > 0 ? j->latency * 0.9 + ms * 0.1 : ms;
+    if(j->fastest == 0 || ms < j->fastest) j->fastest = ms;
+    if(!autotune || ++j->clean < TUNE_ACKS || j->latency > j->fastest * 2 + 2) return;
+    j->clean = 0;
+    if(j->gap > 0) {
+        j->gap /= 2;
+        if(j->gap < 0.1) j->gap = 0;
+    } else if(j->window < j->ceiling) {
+        j->window++;
+    }
+}
+
+/* -A.  A frame or an answer got lost.  The window that did it is too
+   big for this node so it becomes the ceiling.  If we are already down
+   to stop and wait the node gets more time between frames instead. */
+static void
+tune_loss(struct job *j)
+{
+    if(!autotune) return;
+    j->clean = 0;
+    if(j->window > 1) {
+        j->ceiling = j->window - 1;
+        j->window = j->ceiling;
+    } else {
+        j->gap = j->gap > 0 ? j->gap * 2 : (j->latency > 0 ? j->latency / 2 : 1);
+    }
+}
+
+/* Reads the -T file.  Each line is the node, window, ceiling, gap and
+   answer time. */
+static void
+profiles_load(void)
+{
+    FILE *f = fopen(profile_path, "r");
+    struct profile p;
+    char line[128];
+    unsigned node;
+
+    if(f == NULL) return; /* We'll make it */
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(sscanf(line, "%i %i %i %lf %lf", &node, &p.window, &p.ceiling, &p.gap, &p.latency) != 5 ||
+           node > 255 || p.window < 1 || p.ceiling < p.window || p.gap < 0) continue;
+        p.valid = 1;
+        profiles[node] = p;
+    }
+    fclose(f);
+}
+
+/* Puts what we learned about the nodes that finished in the -T file,
+   along with the ones from before that we didn't update this time */
+static int
+profiles_save(struct job *jobs, int njobs)
+{
+    FILE *f;
+    int k;
+
+    for(k = 0; k < njobs; k++) {
+        if(jobs[k].state != JOB_DONE) continue;
+        profiles[jobs[k].node].valid = 1;
+        profiles[jobs[k].node].window = jobs[k].window;
+        profiles[jobs[k].node].ceiling = jobs[k].ceiling;
+        profiles[jobs[k].node].gap = jobs[k].gap;
+        profiles[jobs[k].node].latency = jobs[k].latency;
+    }
+    f = fopen(profile_path, "w");
+    if(f == NULL) {
+        perror(profile_path);
+        return -1;
+    }
+    fprintf(f, "# node window ceiling gap_ms answer_ms\n");
+    for(k = 0; k < 256; k++) {
+        if(!profiles[k].valid) continue;
+        fprintf(f, "0x%02X %d %d %.2f %.2f\n", k, profiles[k].window, profiles[k].ceiling,
+                profiles[k].gap, profiles[k].latency);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Starts asking the node for a firmware update on its channel.  The node
+   only listens for this for about a second after a reset unless its
+   program is bad, so we keep asking until ms runs out. */
+static void
+job_connect(struct job *j, int ms)
+{
+    j->state = JOB_CONNECTING;
+    j->attempts++;
+    j->next = j->oldest = j->retries = j->resends = 0;
+    j->hold = 0;
+    j->deadline = now_ms() + ms;
+}
+
+/* The node has stopped answering.  It keeps listening on its channel
+   until load_firmware() gives up, so if we start it over we have to keep
+   asking until then and nobody else can have the channel. */
+static void
+job_fail(struct job *j, const char *why)
+{
+    double wait;
+
+    fprintf(stderr, "Node 0x%02X: %s\n", j->node, why);
+    if(j->state == JOB_SENDING) chan_free[j->channel] = now_ms() + NODE_GIVES_UP;
+    if(j->attempts <= node_retries) {
+        fprintf(stderr, "Node 0x%02X: starting it over\n", j->node);
+        wait = chan_free[j->channel] - now_ms();
+        job_connect(j, (wait > 0 ? wait : 0) + timeout * 1000);
+        return;
+    }
+    j->state = JOB_FAILED;
+}
+
+/* Gives a waiting job a channel that no node is listening on.  The
+   channels are handed out starting at first. */
+static int
+job_start(struct job *j, struct job *jobs, int njobs, int first)
+{
+    int c, k, ch;
+
+    for(c = 0; c < MAX_CHANNELS; c++) {
+        ch = (first + c) % MAX_CHANNELS;
+        if(now_ms() < chan_free[ch]) continue;
+        for(k = 0; k < njobs; k++) {
+            if((jobs[k].state == JOB_CONNECTING || jobs[k].state == JOB_SENDING) &&
+               jobs[k].channel == ch) break;
+        }
+        if(k < njobs) continue;
+        j->channel = ch;
+        j->chan_id = FIX_2WAY_CHANNEL + ch * 2;
+        job_connect(j, timeout * 1000);
+        return 0;
+    }
+    return -1;
+}
+
+/* Something got lost.  Starts the page over once the node has timed out
+   of the buffer data state and will take commands again. */
+static void
+job_restart(struct job *j, const char *why)
+{
+    struct op *op = &j->ops[j->oldest];
+    int first;
+
+    if(++j->retries > MAX_RETRIES) {
+        job_fail(j, "stopped answering");
+        return;
+    }
+    for(first = j->oldest; first > 0 && j->ops[first - 1].page == op->page; first--);
+    if(op->page >= 0) {
+        fprintf(stderr, "Node 0x%02X: %s at page 0x%05X, trying it again\n",
+                j->node, why, op->page * part->page_size);
+    }
+    tune_loss(j);
+    j->next = j->oldest = first;
+    j->hold = now_ms() + ACK_TIMEOUT;
+}
+
+/* The node's flash doesn't have the CRC that we sent with Complete.  It
+   didn't store it and is waiting for more so we start over from the
+   first page, once. */
+static void
+job_resend(struct job *j, const struct canfd_frame *cf)
+{
+    const struct op *op = &j->ops[j->oldest];
+
+    fprintf(stderr, "Node 0x%02X: the flash CRC is 0x%04X, not 0x%04X\n", j->node,
+            cf->data[1] | cf->data[2] << 8, op->data[1] | op->data[2] << 8);
+    if(++j->resends > 1) {
+        job_fail(j, "the flash doesn't match the image");
+        return;
+    }
+    fprintf(stderr, "Node 0x%02X: sending it all again\n", j->node);
+    j->next = j->oldest = j->retries = 0;
+}
+
+/* Sends the next frame of a job if it has one to send and the bus budget
+   has room.  Returns 1 if something went out. */
+static int
+job_send(struct job *j)
+{
+    uint8_t req[5] = {FIX_FIRMWARE, j->node, BL_VERIFY_LSB, BL_VERIFY_MSB, j->channel};
+    struct op connect = {.length = 5, .ack_length = 3};
+    struct op *op;
+    double t = now_ms();
+
+    if(j->state == JOB_CONNECTING) {
+        if(t > j->deadline) {
+            job_fail(j, "didn't answer");
+            return 0;
+        }
+        if(t < j->hold || !bus_take(&connect)) return 0;
+        if(send_frame(FIX_NODE_SPECIFIC + host, req, 5, 0) < 0) return -1;
+        j->hold = t + CONNECT_RETRY;
+        return 1;
+    }
+    if(j->state != JOB_SENDING || t < j->hold) return 0;
+    if(j->next > j->oldest && t > j->ops[j->oldest].sent + ACK_TIMEOUT) {
+        job_restart(j, "no answer");
+        return 0;
+    }
+    if(j->next == j->count || j->next - j->oldest >= j->window || t < j->last + j->gap) return 0;
+    op = &j->ops[j->next];
+    if((op->wait && j->next > j->oldest) || !bus_take(op)) return 0;
+    if(send_frame(j->chan_id, op->data, op->length, op->fd) < 0) return -1;
+    op->sent = t;
+    j->last = t;
+    j->next++;
+    return 1;
+}
+
+/* Hands a frame from the bus to the job that it belongs to */
+static void
+job_receive(struct job *jobs, int njobs, const struct canfd_frame *cf)
+{
+    uint32_t id = cf->can_id & CAN_SFF_MASK;
+    const struct op *op;
+    struct job *j;
+    int k, i, first;
+
+    for(k = 0; k < njobs; k++) {
+        j = &jobs[k];
+        if(j->state == JOB_CONNECTING && id == (uint32_t)FIX_NODE_SPECIFIC + j->node &&
+           cf->len >= 3 && cf->data[0] == FIX_FIRMWARE && cf->data[1] == host) {
+            if(cf->data[2] != 0x00) {
+                job_fail(j, "refused the update");
+                return;
+            }
+            j->state = JOB_SENDING;
+            j->start = now_ms();
+            if(!quiet) printf("Node 0x%02X is listening on channel %d\n", j->node, j->channel);
+            return;
+        }
+        if(j->state == JOB_SENDING && id == j->chan_id + 1U) break;
+    }
+    if(k == njobs || now_ms() < j->hold) return; /* Not ours or old news */
+    op = &j->ops[j->oldest];
+    if(j->oldest < j->next && op->data[0] == CMD_COMPLETE && cf->len == op->ack_length &&
+       cf->data[0] == CMD_COMPLETE && memcmp(&cf->data[3], &op->ack[3], 4) == 0 &&
+       memcmp(&cf->data[1], &op->ack[1], 2) != 0) {
+        job_resend(j, cf);
+        return;
+    }
+    if(j->oldest < j->next && op->ack[0] == CMD_EE_READ && op->ack_length > 3 &&
+       cf->len == op->ack_length && memcmp(cf->data, op->ack, 3) == 0 && memcmp(&cf->data[3], &op->ack[3], cf->len - 3) != 0) {
+        char why[64];
+        snprintf(why, sizeof(why), "EEPROM at 0x%04X doesn't read back right",
+                 op->ack[1] | op->ack[2] << 8);
+        job_fail(j, why);
+        return;
+    }
+    for(i = j->oldest; i < j->next && !fw_ack_matches(&j->ops[i], cf); i++);
+    if(i == j->next) return;
+    if(i > j->oldest) {
+        /* It skipped one, so a frame or an answer got lost */
+        job_restart(j, "lost a frame");
+        return;
+    }
+    j->oldest++;
+    tune_answer(j, now_ms() - j->ops[i].sent);
+    if(adapt && cf->len == 5 && j->ops[i].ack_length == 2) bus_adjust(j, cf);
+    if(j->ops[i].page >= 0 && j->ops[i + 1].page != j->ops[i].page) {
+        /* That was the Write for the page */
+        j->retries = 0;
+        for(first = i; first > 0 && j->ops[first - 1].page == j->ops[i].page; first--);
+        if(!quiet) printf("  0x%02X page 0x%05X  %7.2f mS\n", j->node,
+                          j->ops[i].page * part->page_size, now_ms() - j->ops[first].sent);
+    }
+    if(j->oldest == j->count) {
+        /* The node resets after it answers the Complete command */
+        j->state = JOB_DONE;
+        chan_free[j->channel] = 0;
+        if(!quiet) printf("Node 0x%02X done in %.1f mS\n", j->node, now_ms() - j->start);
+    }
+}
+
+/* Runs all of the jobs, up to max_active at a time.  The jobs take turns
+   sending one frame each, starting with the one after the job that went
+   first last time, so none of them can hog the bus. */
+static int
+run(struct job *jobs, int njobs, int max_active, int first_channel)
+{
+    struct canfd_frame cf;
+    int k, active, waiting, turn = 0, sent, done = 0;
+    double start = now_ms();
+
+    bus_last = start;
+    while(1) {
+        active = waiting = 0;
+        for(k = 0; k < njobs; k++) {
+            if(jobs[k].state == JOB_CONNECTING || jobs[k].state == JOB_SENDING) active++;
+            if(jobs[k].state == JOB_WAITING) waiting++;
+        }
+        if(active == 0 && waiting == 0) break;
+        for(k = 0; k < njobs && active < max_active; k++) {
+            if(jobs[k].state == JOB_WAITING && job_start(&jobs[k], jobs, njobs, first_channel) == 0) active++;
+        }
+        sent = 0;
+        for(k = 0; k < njobs; k++) {
+            switch(job_send(&jobs[(turn + k) % njobs])) {
+            case -1: return -1;
+            case 1: sent = 1;
+            }
+        }
+        turn = (turn + 1) % njobs;
+        /* Don't wait for answers if there is more to send */
+        while(sc_recv(sock, &cf, NULL, sent ? 0 : 1) == 1) {
+            job_receive(jobs, njobs, &cf);
+            sent = 1;
+        }
+    }
+    for(k = 0; k < njobs; k++) if(jobs[k].state == JOB_DONE) done++;
+    if(!quiet || done < njobs) {
+        printf("%d of %d nodes updated in %.1f mS\n", done, njobs, now_ms() - start);
+    }
+    if(backoffs && !quiet) printf("Backed off %d times for a busy bus\n", backoffs);
+    for(k = 0; k < njobs && autotune && !quiet; k++) {
+        if(jobs[k].state != JOB_DONE) continue;
+        printf("Node 0x%02X: window %d of %d, %.2f mS between frames, answers in %.2f mS\n",
+               jobs[k].node, jobs[k].window, jobs[k].ceiling, jobs[k].gap, jobs[k].latency);
+    }
+    if(profile_path != NULL && profiles_save(jobs, njobs) < 0) return -1;
+    return done == njobs ? 0 : -1;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: canfix-upload [-i interface] -n node [options] file\n"
+                    "       canfix-upload [-i interface] [options] node:file ...\n"
+                    "       canfix-upload [-i interface] [options] node:file:old ...\n"
+                    "  file is Intel HEX, an AVR ELF file, a raw binary or a canfix-pack\n"
+                    "  plan.  Which one is worked out from what's in it.\n"
+                    "  file can be - with -e to only write the EEPROM.\n"
+                    "  -o what the nodes have now, only what changed is sent\n"
+                    "  -e EEPROM image, only the bytes that are in it are written\n"
+                    "  -s our node                  (0x01)\n"
+                    "  -c first two way channel     (0)\n"
+                    "  -m 328p|2561                 (328p)\n"
+                    "  -w frames that can wait for an answer, 1 is stop and wait (2)\n"
+                    "  -t seconds to keep asking a node to start (10)\n"
+                    "  -r times to start a node over that stops answering (1)\n"
+                    "  -j nodes to update at once   (16)\n"
+                    "  -b bus bit rate              (125000)\n"
+                    "  -d CAN FD data bit rate      (the bus bit rate)\n"
+                    "  -l percent of the bus to use (80)\n"
+                    "  -p priority of the node's answers, 0-3 (3)\n"
+                    "  -P mS between the node's answers (0)\n"
+                    "  -a back off when the nodes say the bus is busy\n"
+                    "  -A tune -w and the time between frames for each node\n"
+                    "  -T file to keep what -A learns about each node in\n"
+                    "  -F sends the buffer data in 64 byte CAN FD frames.\n"
+                    "  -q only prints errors\n");
+    exit(1);
+}
+
+/* Adds the -e EEPROM image to a job's frames.  They go ahead of the
+   Complete command since the node resets after that, or if there's no
+   firmware they get a Reset of their own. */
+static int
+job_eeprom(struct job *j, int fd)
+{
+    uint8_t image[part->eeprom_size], used[part->eeprom_size];
+    struct op *ee;
+    long size;
+    int count, k, bytes = 0;
+
+    memset(image, 0xFF, sizeof(image));
+    memset(used, 0, sizeof(used));
+    size = fw_load_used(ee_path, image, used, sizeof(image));
+    if(size < 0) return -1;
+    ee = fw_eeprom_ops(image, used, size, fd, j->ops == NULL, &count);
+    if(ee == NULL) return -1;
+    j->ops = realloc(j->ops, (j->count + count) * sizeof(*j->ops));
+    if(j->ops == NULL) return -1;
+    if(j->count > 0) {
+        /* Complete is last */
+        j->ops[j->count + count - 1] = j->ops[j->count - 1];
+        memcpy(&j->ops[j->count - 1], ee, count * sizeof(*ee));
+    } else {
+        memcpy(j->ops, ee, count * sizeof(*ee));
+    }
+    j->count += count;
+    free(ee);
+    for(k = 0; k < (long)size; k++) bytes += used[k];
+    if(!quiet) printf("%s: %d EEPROM bytes\n", ee_path, bytes);
+    return 0;
+}
+
+/* Takes a job's frames from a canfix-pack transfer plan */
+static int
+job_plan(struct job *j, const char *path, const char *old_path, int fd)
+{
+    struct fw_plan plan;
+
+    if(old_path != NULL) {
+        fprintf(stderr, "%s: a transfer plan can't be patched, give canfix-pack -o instead\n", path);
+        return -1;
+    }
+    j->ops = fw_plan_load(path, &plan, &j->count);
+    if(j->ops == NULL) return -1;
+    if(plan.page_size != part->page_size || plan.fd != fd) {
+        fprintf(stderr, "%s: packed for %u byte pages%s, not %u%s\n", path, plan.page_size,
+                plan.fd ? " with -F" : "", part->page_size, fd ? " with -F" : "");
+        return -1;
+    }
+    if(!quiet) {
+        printf("%s: %u bytes in %d frames, CRC 0x%04X\n", path, plan.size, j->count, plan.crc);
+    }
+    return 0;
+}
+
+/* Loads the image for a job and works out its frames */
+static int
+job_image(struct job *j, const char *path, const char *old_path, int fd)
+{
+    uint8_t *image, *old = NULL;
+    long size, old_size = 0;
+    int k, pages = 0;
+
+    image = malloc(part->app_size);
+    if(image == NULL) return -1;
+    memset(image, 0xFF, part->app_size);
+    if(old_path != NULL) {
+        old = malloc(part->app_size);
+        if(old == NULL) return -1;
+        memset(old, 0xFF, part->app_size);
+        old_size = fw_load(old_path, old, part->app_size);
+        if(old_size < 0) return -1;
+        memcpy(image, old, part->app_size);
+    }
+    size = fw_load(path, image, part->app_size);
+    if(size >= 0 && size < old_size) size = old_size;
+    if(size > 0) j->ops = fw_ops(image, old, size, part->page_size, fd, &j->count);
+    if(j->ops != NULL && !quiet) {
+        printf("%s: %ld bytes in %ld pages, CRC 0x%04X\n", path, size,
+               (size + part->page_size - 1) / part->page_size, fw_crc16(image, size));
+        if(old != NULL) {
+            for(k = 0; k < j->count; k++) {
+                if(j->ops[k].page >= 0 && (k == 0 || j->ops[k].page != j->ops[k - 1].page)) pages++;
+            }
+            printf("%s: %d pages changed since %s\n", path, pages, old_path);
+        }
+    }
+    free(image);
+    free(old);
+    return j->ops != NULL ? 0 : -1;
+}
+
+/* Works out the frames for one node */
+static int
+job_load(struct job *j, long node, const char *path, const char *old_path, int fd)
+{
+    if(node < 0 || node > 255) usage();
+    memset(j, 0, sizeof(*j));
+    j->node = node;
+    j->path = path;
+    j->window = window;
+    j->ceiling = autotune ? MAX_WINDOW : window;
+    if(autotune && profiles[node].valid) {
+        /* Start where we left off */
+        j->window = profiles[node].window;
+        j->ceiling = profiles[node].ceiling;
+        j->gap = profiles[node].gap;
+    }
+    if(strcmp(path, "-") == 0) {
+        /* Only the EEPROM */
+        if(ee_path == NULL) usage();
+        return job_eeprom(j, fd);
+    }
+    if(fw_is_plan(path)) {
+        if(job_plan(j, path, old_path, fd) < 0) return -1;
+    } else if(job_image(j, path, old_path, fd) < 0) {
+        return -1;
+    }
+    if(priority >= 0 || pace > 0 || adapt) {
+        /* Pacing goes first, in with the first page */
+        j->ops = realloc(j->ops, (j->count + 1) * sizeof(*j->ops));
+        if(j->ops == NULL) return -1;
+        memmove(&j->ops[1], &j->ops[0], j->count * sizeof(*j->ops));
+        fw_pacing(&j->ops[0], j->ops[1].page, priority >= 0 ? priority : 3, pace, adapt);
+        j->count++;
+    }
+    return ee_path != NULL ? job_eeprom(j, fd) : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *ifname = "vcan0";
+    long node = -1, channel = 0, max_active = MAX_CHANNELS, load = 80;
+    int fd = 0, c, njobs, k;
+    struct job *jobs;
+    char *colon, *old;
+
+    while((c = getopt(argc, argv, "i:n:s:c:m:w:t:r:j:b:d:l:o:e:p:P:aAT:Fq")) != -1) {
+        switch(c) {
+        case 'i': ifname = optarg; break;
+        case 'n': node = strtol(optarg, NULL, 0); break;
+        case 's': host = strtol(optarg, NULL, 0); break;
+        case 'c': channel = strtol(optarg, NULL, 0); break;
+        case 'm':
+            part = fw_find_part(optarg);
+            if(part == NULL) usage();
+            break;
+        case 'w': window = strtol(optarg, NULL, 0); break;
+        case 't': timeout = strtol(optarg, NULL, 0); break;
+        case 'r': node_retries = strtol(optarg, NULL, 0); break;
+        case 'j': max_active = strtol(optarg, NULL, 0); break;
+        case 'b': bitrate = strtod(optarg, NULL); break;
+        case 'd': data_bitrate = strtod(optarg, NULL); break;
+        case 'l': load = strtol(optarg, NULL, 0); break;
+        case 'o': old_path = optarg; break;
+        case 'e': ee_path = optarg; break;
+        case 'p': priority = strtol(optarg, NULL, 0); break;
+        case 'P': pace = strtol(optarg, NULL, 0); break;
+        case 'a': adapt = 1; break;
+        case 'A': autotune = 1; break;
+        case 'T': profile_path = optarg; break;
+        case 'F': fd = 1; break;
+        case 'q': quiet = 1; break;
+        default: usage();
+        }
+    }
+    njobs = argc - optind;
+    if(njobs < 1 || (node >= 0 && njobs != 1) || channel < 0 || channel >= MAX_CHANNELS ||
+       window < 1 || node_retries < 0 || max_active < 1 || bitrate <= 0 ||
+       data_bitrate < 0 || load < 1 || load > 100 || priority > 3 || pace < 0 || pace > 255) usage();
+    if(data_bitrate == 0) data_bitrate = bitrate;
+    bus_rate = bus_max = bitrate * load / 100 / 1000;
+    if(profile_path != NULL) profiles_load();
+
+    jobs = calloc(njobs, sizeof(*jobs));
+    if(jobs == NULL) return 1;
+    for(k = 0; k < njobs; k++) {
+        if(node >= 0) {
+            if(job_load(&jobs[k], node, argv[optind + k], old_path, fd) < 0) return 1;
+            continue;
+        }
+        /* node:file or node:file:old */
+        colon = strchr(argv[optind + k], ':');
+        if(colon == NULL) usage();
+        *colon = '\0';
+        old = strchr(colon + 1, ':');
+        if(old != NULL) *old++ = '\0';
+        if(job_load(&jobs[k], strtol(argv[optind + k], NULL, 0), colon + 1,
+                    old != NULL ? old : old_path, fd) < 0) return 1;
+    }
+
+    sock = sc_open(ifname, fd);
+    if(sock < 0) {
+        perror(ifname);
+        return 1;
+    }
+    return run(jobs, njobs, max_active, channel) < 0 ? 1 : 0;
+}